@@ -35,6 +35,11 @@ Name: Yusuf Nadir Cavus
 #include <signal.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
 
 #define WHITESPACE " \t\n"      // We want to split our command line up into tokens
                                 // so we need to define what delimits our tokens.
@@ -51,9 +56,78 @@ Name: Yusuf Nadir Cavus
 #define NUM_BLOCKS 4226
 #define BLOCK_SIZE 8192
 
-unsigned char data_blocks[NUM_BLOCKS][BLOCK_SIZE];
-int used_blocks[NUM_BLOCKS];
-char *open_file = NULL;
+#define LIST_DATE_SIZE 26       // Room for a ctime() style date without the newline
+#define LIST_LINE_SIZE 96       // Upper bound on one formatted list line
+#define LIST_DEFAULT_PAGE 20    // Entries per page when -p is given without -n
+
+#define EXTENT_CLASSES 13        // Free extent size classes, class c holds runs of 2^c to 2^(c+1)-1 blocks
+#define FRAG_BUCKETS 14           // Free extent histogram buckets, one per power of two
+#define RECLAIM_LOW_WATER ((NUM_BLOCKS - 130) / 10)  // Free blocks the background reclaim pass keeps available
+
+#define PATH_MAX_LEN 4096
+#define STATS_SUB_BUCKETS 8       // Latency histogram buckets per power of two nanoseconds
+#define STATS_BUCKETS (64 * STATS_SUB_BUCKETS)
+
+#define TRACE_RING_SIZE 4096       // Events kept per thread, must be a power of two
+#define TRACE_MAX_THREADS 16
+
+#define READ_BYTES_PER_LINE 16      // Bytes per line of the read hex dump
+
+#define MAX_OPEN_FILES 32            // Entries in the open file table
+#define PACK_MAX_FILE (BLOCK_SIZE / 4)  // Largest file put packs into a shared block
+#define PACK_ALIGN 8                 // Slices in a pack block start at multiples of this
+#define PACK_SPARSE 4                // A pack block under 1/PACK_SPARSE live is compacted
+#define ENTRY_STAGED 2               // valid of a file put inside a transaction, not yet visible
+
+#define DIRTY_WORDS ((NUM_BLOCKS + 63) / 64)
+#define FLUSH_MAX_RUN 256           // Most blocks the flusher coalesces into one write
+#define IMAGE_MAGIC 0x3153464d      // "MFS1", marks the name table at the end of an image
+#define STRIPE_MAGIC 0x5453464d     // "MFST", marks the stripe table after the name table
+#define MAX_STRIPES 8               // Backing files one image can be striped over
+#define STRIPE_DEFAULT_UNIT 16      // Blocks per stripe unit unless createfs -u says otherwise
+
+#define BLOCK_MISSING 0             // Block states of the data block cache
+#define BLOCK_LOADING 1
+#define BLOCK_LOADED 2
+#define PREFETCH_QUEUE 1024         // Blocks waiting for the prefetch thread
+#define RA_INITIAL_WINDOW 4         // Readahead window once a file is read sequentially
+#define RA_MAX_WINDOW MAX_BLOCKS_PER_FILE
+
+#define MAX_MOUNTS 16                // Mounted file systems, the unnamed one included
+#define CACHE_DEFAULT_BUDGET (NUM_BLOCKS - 130)  // Data blocks all mounts may keep loaded
+
+#define HEAT_DECAY_COMMANDS 256     // Commands between halvings of the access counters
+#define HEAT_MAX 65535
+#define HEAT_TOP_FILES 10           // Files heat lists, hottest first
+
+#define SCRATCH_SIZE (4 * MAX_COMMAND_SIZE)  // Parse memory per command, the line and its tokens fit twice over
+#define NAME_SLAB_SLOTS 256         // Name slots the name slab grows by
+
+#define DIRECT_ALIGN 4096           // Buffer, offset and length alignment for O_DIRECT
+#define ALIGN_UP(n) (((n) + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN)
+
+#define ARCHIVE_BUFFER (128 * BLOCK_SIZE)  // Bytes export and import move per read or write
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK)       // Archives are padded to whole records like tar does
+#define TAR_NAME_SIZE 100
+#define PAX_HIDDEN "MFS.hidden"           // pax keyword that carries the hidden attribute
+
+#define RECORD_MAGIC 0x5253464d      // "MFSR", starts a workload recording
+#define RECORD_VERSION 1
+
+#define FSCK_MAX_THREADS 16         // Most threads one fsck pass is split across
+#define FSCK_BAD_BLOCK 1            // Inode problems found by the fsck inode pass
+#define FSCK_MAP_HOLE 2
+#define FSCK_BAD_SIZE 4
+#define FSCK_BAD_PACK 8
+#define FSCK_BLOCK_OK 0             // Block problems found by the fsck block pass
+#define FSCK_BLOCK_LEAKED 1
+#define FSCK_BLOCK_UNMARKED 2
+#define FSCK_BLOCK_MISCOUNTED 3
+
+#define LIST_SORT_NAME 0
+#define LIST_SORT_SIZE 1
+#define LIST_SORT_DATE 2
 
 struct directory_entry {
   char *name;
@@ -63,806 +137,7334 @@ struct directory_entry {
   int read_only;
 };
 
-struct directory_entry *directory_ptr;
-
 struct inode {
   time_t date;
   int valid;
   int size;
   int blocks[MAX_BLOCKS_PER_FILE];
+  int packed;            // blocks[0] is a pack block shared with other small files
+  int pack_offset;       // where the file's bytes start in it
 };
 
-struct inode *inode_array_ptr[NUM_INODES];
+// The open file table.  A handle caches the file's directory slot and
+// inode, so reads and writes through it never search the directory.
+// A handle opened on a host file that is not in the file system yet has
+// a dir_idx of -1 until save imports it.
+struct open_file {
+  char *name;
+  int dir_idx;
+  int inode_idx;
+  struct inode *inode;
+  int offset;
+};
 
-void init()
+// Deleted files waiting to be reclaimed, indexed by inode.  The inode
+// keeps its full block map while it is here so undel is exact, and the
+// list runs from the oldest deletion at the head to the newest at the tail.
+struct tombstone {
+  char *name;
+  int hidden;
+  int read_only;
+  int prev;
+  int next;
+};
+
+// The name table stored after the blocks of an image.  Directory entries
+// and tombstones only hold pointers to their names, so the names
+// themselves are kept here.
+struct image_names {
+  unsigned int magic;
+  char dir_names[NUM_FILES][MAX_FILE_NAME + 1];
+  char tomb_names[NUM_INODES][MAX_FILE_NAME + 1];
+  int tomb_hidden[NUM_INODES];
+  int tomb_read_only[NUM_INODES];
+  int tomb_order[NUM_INODES];   // oldest deletion first, -1 terminated
+};
+
+// Stored after the name table of an image striped over several backing
+// files.  Stripe unit u of the blocks lives on member u % count, member
+// 0 being the image file itself.  Single file images have no table.
+struct image_stripes {
+  unsigned int magic;
+  int count;
+  int unit;                     // blocks per stripe unit
+  char paths[MAX_STRIPES][PATH_MAX_LEN];
+};
+
+// Everything about one mounted file system.  The first mount is the
+// unnamed one the shell starts with, the mount command adds named ones
+// whose files are reached as alias:file.
+struct mount {
+  char *alias;
+
+  // Mapped anonymously, so blocks that were never loaded cost no
+  // memory.  Page aligned, so every block can be the buffer of an
+  // O_DIRECT transfer.
+  unsigned char (*data_blocks)[BLOCK_SIZE];
+
+  // Number of inodes mapping each block, 0 when it is free.  Files made
+  // by cp share their blocks, a shared block is copied before it is written.
+  int used_blocks[NUM_BLOCKS];
+
+  struct directory_entry *directory_ptr;
+  struct inode *inode_array_ptr[NUM_INODES];
+
+  struct open_file open_files[MAX_OPEN_FILES];
+
+  // Ordered indexes over the valid directory entries, one per list sort key.
+  // They are kept sorted as entries come and go so list never has to sort
+  // or scan the whole directory.
+  int list_index[3][NUM_FILES];
+  int list_index_count;
+
+  // The formatted date of every inode, filled in once when the inode is
+  // written so list does not call ctime() for every entry it prints.
+  char inode_date_str[NUM_INODES][LIST_DATE_SIZE];
+
+  // Free extent allocator.  Every run of free blocks is linked into the
+  // list of its size class through its first block; the last block of a
+  // run points back at the first so neighbours can be merged on release.
+  int extent_len[NUM_BLOCKS];       // length of the free run starting here, 0 if none
+  int extent_first[NUM_BLOCKS];     // first block of the free run ending here, -1 if none
+  int extent_next[NUM_BLOCKS];
+  int extent_prev[NUM_BLOCKS];
+  int extent_head[EXTENT_CLASSES];
+  int free_blocks;
+
+  struct tombstone tombstones[NUM_INODES];
+  int tombstone_head;
+  int tombstone_tail;
+  int reclaimable_blocks;
+
+  // Writeback.  Every block changed since it was last written to the
+  // image has its bit set in dirty_bitmap.  The flusher thread writes the
+  // dirty blocks back in runs of adjacent blocks, starting once more than
+  // dirty_background_ratio percent of the blocks are dirty or the oldest
+  // change is dirty_expire_secs old.  Past dirty_ratio percent, commands
+  // wait for writeback before they run.  Commands run with fs_lock held
+  // and the flusher only drops it around its writes.
+  unsigned long dirty_bitmap[DIRTY_WORDS];
+  int dirty_count;
+
+  int image_fd;
+  char *image_path;
+  int image_direct_fd;
+
+  // Members 1 and up of a striped image, member 0 is image_fd
+  int stripe_count;       // 1 for a single file image
+  int stripe_unit;
+  int stripe_fd[MAX_STRIPES];
+  int stripe_direct_fd[MAX_STRIPES];
+  char *stripe_path[MAX_STRIPES];
+
+  pthread_cond_t flush_wake;
+  pthread_cond_t flush_done;
+  pthread_t flush_thread;
+  int flush_running;
+  int sync_ticket;        // bumped by every sync request
+  int sync_completed;     // last request whose data is on disk
+  int flush_error;
+  unsigned char *flush_buffer;
+  struct image_names flush_names;
+  int flush_first;        // run being written with fs_lock dropped,
+  int flush_run;          // the cache must not evict it meanwhile
+
+  // Data block cache.  After openfs only the metadata blocks are read in,
+  // every data block starts BLOCK_MISSING and is read from the image the
+  // first time it is needed.  The prefetch thread reads blocks queued by
+  // readahead ahead of time; a block it is reading is BLOCK_LOADING and
+  // anyone who needs it waits on block_loaded.  block_ref is set on
+  // every access and cleared by the eviction clock.
+  unsigned char block_state[NUM_BLOCKS];
+  unsigned char block_ref[NUM_BLOCKS];
+
+  // Access counters of the data blocks and files, halved every
+  // HEAT_DECAY_COMMANDS commands so they follow the current working set.
+  unsigned short block_heat[NUM_BLOCKS];
+  unsigned int file_heat[NUM_INODES];
+
+  // Digest of each whole data block as sync last saw it, good until the
+  // block is marked dirty again.  Lets sync compare blocks it would
+  // otherwise have to read back from the image.
+  uint64_t block_hash[NUM_BLOCKS];
+  unsigned char block_hashed[NUM_BLOCKS];
+
+  pthread_cond_t prefetch_wake;
+  pthread_t prefetch_thread;
+  int prefetch_running;
+  int prefetch_queue[PREFETCH_QUEUE];
+  int prefetch_head;
+  int prefetch_count;
+  int prefetch_busy;
+
+  // Sequential readahead, per inode.  ra_next is the block entry a
+  // sequential reader would ask for next.  The window doubles while the
+  // reader keeps asking for it and halves when it jumps somewhere else.
+  int ra_next[NUM_INODES];
+  int ra_window[NUM_INODES];
+  int ra_issued[NUM_INODES];     // entries below this have been queued already
+
+  // Where the next incremental defrag pass picks up in the directory
+  int defrag_cursor;
+
+  // Small files are packed back to back into shared pack blocks.  A
+  // pack block's used_blocks count is the number of slices in it.  New
+  // slices go at pack_used in pack_block; pack_sparse is set when a
+  // slice went away, so the loop looks for blocks worth compacting.
+  int pack_block;
+  int pack_used;
+  int pack_sparse;
+  unsigned char pack_blocks[NUM_BLOCKS];
+
+  // The open transaction, if any.  Files put inside it are ENTRY_STAGED
+  // until commit; deletions, by inode, and attribute changes are held
+  // here until then.  On disk the directory block is the switch: openfs
+  // drops staged entries, so a transaction that never committed leaves
+  // nothing.
+  int txn_active;
+  unsigned char txn_del[NUM_INODES];
+  signed char txn_hidden[NUM_FILES];      // -1 when unchanged
+  signed char txn_read_only[NUM_FILES];
+};
+
+struct mount *mounts[MAX_MOUNTS];
+
+// Bump allocator for memory that only lives while one command runs.
+// Nothing is freed on its own, the shell resets the arena before it
+// reads the next command.
+struct arena {
+  char *base;
+  size_t size;
+  size_t used;
+};
+
+char scratch_buf[SCRATCH_SIZE];
+struct arena scratch = { scratch_buf, SCRATCH_SIZE, 0 };
+
+// Names of directory entries, tombstones and open files.  Every name
+// fits a fixed size slot and freed slots are kept on a free list, so
+// the slab only grows to the most names that were alive at once.  Names
+// are only allocated and freed with fs_lock held.
+union name_slot {
+  union name_slot *next;
+  char name[MAX_FILE_NAME + 1];
+};
+
+union name_slot *name_free_list = NULL;
+
+// The mount the calling thread works on.  The shell points it at the
+// mount a command names, background threads at the mount they serve.
+__thread struct mount *mnt;
+
+// Direct I/O mode.  Block transfers to and from the image, and the data
+// of put and get, bypass the host page cache.  The image keeps its
+// buffered descriptor for the unaligned name table at its end.
+int direct_io = 0;
+
+int dirty_background_ratio = 10;
+int dirty_ratio = 40;
+int dirty_expire_secs = 5;
+
+// Commands, and the flushers whenever they touch a mount, hold fs_lock.
+// cache_lock covers the block states and prefetch queues of every mount,
+// not the block contents.
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t block_loaded = PTHREAD_COND_INITIALIZER;
+
+unsigned long flush_writes = 0;
+unsigned long flush_blocks = 0;
+
+unsigned long ra_hits = 0;     // accesses to a block readahead had loaded
+unsigned long ra_misses = 0;   // accesses that had to read the image
+unsigned long ra_prefetched = 0;
+
+// Data blocks of all image backed mounts share one budget.  Past it,
+// clean blocks are evicted between commands by a clock that sweeps
+// every mount and gives recently used blocks a second chance.
+int cache_budget = CACHE_DEFAULT_BUDGET;
+unsigned long heat_commands = 0;
+int clock_mount = 0;
+int clock_block = 130;
+unsigned long cache_evictions = 0;
+
+// A ustar header.  Every numeric field is zero padded octal text.
+struct tar_header {
+  char name[TAR_NAME_SIZE];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+};
+
+// An archive being written by export or read by import.  len is how
+// much of buf is filled and pos how much of that has been read.
+struct archive {
+  int fd;
+  unsigned char *buf;
+  size_t len;
+  size_t pos;
+  unsigned long offset;
+};
+
+unsigned char archive_buf[ARCHIVE_BUFFER];
+unsigned char tar_zeros[TAR_RECORD];
+
+// Scratch state of fsck.  fsck_claims counts the inodes that map a
+// block, which is what used_blocks should hold.  A job is the slice of
+// inodes or blocks one worker thread checks.
+int fsck_repair = 0;
+int fsck_in_use[NUM_INODES];
+int fsck_claims[NUM_BLOCKS];
+unsigned char fsck_block_status[NUM_BLOCKS];
+
+// What the inode pass found, kept as it was before any repair.
+// map_len is the number of good entries at the front of the map.
+struct fsck_inode {
+  int flags;
+  int map_len;
+  int bad_block;
+  int size;
+  int mapped;
+  int pack_offset;
+};
+
+struct fsck_inode fsck_inodes[NUM_INODES];
+struct fsck_job {
+  pthread_t thread;
+  struct mount *mount;
+  int first;
+  int last;
+  int problems;
+};
+
+// Per command counters and latency histograms.  The histograms are
+// log-linear like HDR histograms: every power of two nanoseconds is
+// split into STATS_SUB_BUCKETS equal buckets, so the relative error of
+// a percentile stays below 1/STATS_SUB_BUCKETS at any scale.  Updates
+// are atomic because the prometheus dump thread reads them live.
+enum stats_op {
+  OP_PUT, OP_GET, OP_DEL, OP_UNDEL, OP_LIST, OP_DF, OP_OPEN, OP_SAVE,
+  OP_CLOSE, OP_ATTRIB, OP_DEFRAG, OP_FRAG, OP_READ, OP_WRITE, OP_APPEND,
+  OP_TRUNCATE, OP_SEEK, OP_SYNC, OP_FSCK, OP_CP, OP_MV, OP_EXPORT, OP_IMPORT, OP_RECORD,
+  OP_MOUNT, OP_UMOUNT, OP_OTHER, NUM_OPS
+};
+
+char *stats_op_names[NUM_OPS] = {
+  "put", "get", "del", "undel", "list", "df", "open", "save",
+  "close", "attrib", "defrag", "frag", "read", "write", "append",
+  "truncate", "seek", "sync", "fsck", "cp", "mv", "export", "import", "record",
+  "mount", "umount", "other"
+};
+
+struct op_stats {
+  unsigned long count;
+  unsigned long bytes;
+  unsigned long total_ns;
+  unsigned long max_ns;
+  unsigned long histogram[STATS_BUCKETS];
+};
+
+// How far the allocator helpers had to look before they found a slot
+enum stats_scan {
+  SCAN_FREE_DIR, SCAN_FREE_INODE, SCAN_FREE_BLOCK, SCAN_FILE_DIR_IDX,
+  SCAN_EXTENT_LIST, NUM_SCANS
+};
+
+char *stats_scan_names[NUM_SCANS] = {
+  "findFreeDirectoryEntry", "findFreeInode", "findFreeBlock",
+  "find_file_dir_idx", "extent_alloc_run"
+};
+
+struct scan_stats {
+  unsigned long calls;
+  unsigned long scanned;
+  unsigned long max;
+};
+
+struct op_stats op_stats[NUM_OPS];
+struct scan_stats scan_stats[NUM_SCANS];
+
+int stats_current_op = -1;
+unsigned long stats_op_start = 0;
+
+char *stats_prom_path = NULL;
+int stats_prom_interval = 0;
+int stats_prom_running = 0;
+pthread_t stats_prom_thread;
+
+unsigned long now_ns()
 {
-  directory_ptr = (struct directory_entry *) &data_blocks[0];
+  struct timespec ts;
 
-  for (int i = 0; i < NUM_FILES; i++)
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+#define STATS_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define STATS_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+int stats_bucket (unsigned long ns)
+{
+  if (ns < STATS_SUB_BUCKETS)
   {
-    directory_ptr[i].valid = 0; 
-    directory_ptr[i].hidden = 0;
-    directory_ptr[i].read_only = 0;
+    return ns;
   }
 
-  int inode_idx = 0;
-  for (int i = 1; i < 130; i++)
+  int exp = 63 - __builtin_clzl(ns);
+  int sub = (ns >> (exp - 3)) & (STATS_SUB_BUCKETS - 1);
+
+  return (exp - 2) * STATS_SUB_BUCKETS + sub;
+}
+
+//smallest value that lands in the bucket
+unsigned long stats_bucket_floor (int bucket)
+{
+  if (bucket < STATS_SUB_BUCKETS)
   {
-    inode_array_ptr[inode_idx++] = (struct inode *) &data_blocks[i];
+    return bucket;
   }
 
-  for (int i = 0; i < 130; i++)
+  int exp = bucket / STATS_SUB_BUCKETS + 2;
+  int sub = bucket % STATS_SUB_BUCKETS;
+
+  return (1UL << exp) + ((unsigned long) sub << (exp - 3));
+}
+
+void stats_scan (int scan, int scanned)
+{
+  STATS_ADD(scan_stats[scan].calls, 1);
+  STATS_ADD(scan_stats[scan].scanned, scanned);
+  if ((unsigned long) scanned > STATS_GET(scan_stats[scan].max))
   {
-    used_blocks[i] = 1;
+    __atomic_store_n(&scan_stats[scan].max, scanned, __ATOMIC_RELAXED);
   }
-  for (int i = 130; i < NUM_BLOCKS; i++)
+}
+
+//count bytes moved by the command that is running
+void stats_bytes (unsigned long bytes)
+{
+  if (stats_current_op != -1)
   {
-    used_blocks[i] = 0;
+    STATS_ADD(op_stats[stats_current_op].bytes, bytes);
   }
+}
 
-  for (int i = 0; i < NUM_INODES; i++)
+void stats_op_begin (char *cmd)
+{
+  stats_current_op = OP_OTHER;
+  for (int op = 0; op < OP_OTHER; op++)
   {
-    for (int j = 0; j < MAX_BLOCKS_PER_FILE; j++)
+    if (!strcmp(cmd, stats_op_names[op]))
     {
-      inode_array_ptr[i]->blocks[j] = -1;
+      stats_current_op = op;
+      break;
     }
   }
 
+  stats_op_start = now_ns();
 }
 
-int df() 
+//account the command started by stats_op_begin, if any
+void stats_op_end()
 {
-  int count = 0;
+  if (stats_current_op == -1)
+  {
+    return;
+  }
 
-  for (int i = 130; i < NUM_BLOCKS; i++)
+  struct op_stats *st = &op_stats[stats_current_op];
+  unsigned long ns = now_ns() - stats_op_start;
+
+  STATS_ADD(st->count, 1);
+  STATS_ADD(st->total_ns, ns);
+  STATS_ADD(st->histogram[stats_bucket(ns)], 1);
+  if (ns > STATS_GET(st->max_ns))
   {
-    if (used_blocks[i] == 0) count++;
+    __atomic_store_n(&st->max_ns, ns, __ATOMIC_RELAXED);
   }
 
-  return count * BLOCK_SIZE; 
+  stats_current_op = -1;
 }
 
-int findFreeDirectoryEntry() 
+//latency below which the given fraction of the commands completed
+unsigned long stats_percentile (struct op_stats *st, double fraction)
 {
-  int ret = -1;
+  unsigned long count = STATS_GET(st->count);
+  unsigned long target = (unsigned long) (fraction * count);
+  unsigned long seen = 0;
 
-  for (int i = 0; i < NUM_FILES; i++)
+  for (int b = 0; b < STATS_BUCKETS; b++)
   {
-    if (directory_ptr[i].valid == 0)
+    seen += STATS_GET(st->histogram[b]);
+    if (seen > target)
     {
-      ret = i;
-      break;
+      return stats_bucket_floor(b);
     }
   }
 
-  return ret;
+  return STATS_GET(st->max_ns);
 }
 
-int findFreeInode()
+void stats_print()
 {
-  int ret = -1;
+  printf("%-8s %8s %12s %10s %10s %10s %10s\n",
+         "op", "count", "bytes", "p50 us", "p90 us", "p99 us", "max us");
 
-  for (int i = 0; i < NUM_INODES; i++)
+  for (int op = 0; op < NUM_OPS; op++)
   {
-    if (inode_array_ptr[i]->valid == 0)
+    struct op_stats *st = &op_stats[op];
+
+    if (STATS_GET(st->count) == 0)
     {
-      ret = i;
-      break;
+      continue;
     }
+
+    printf("%-8s %8lu %12lu %10.1f %10.1f %10.1f %10.1f\n", stats_op_names[op],
+           STATS_GET(st->count), STATS_GET(st->bytes),
+           stats_percentile(st, 0.50) / 1000.0, stats_percentile(st, 0.90) / 1000.0,
+           stats_percentile(st, 0.99) / 1000.0, STATS_GET(st->max_ns) / 1000.0);
   }
 
-  return ret;
-}
+  printf("\nwriteback: %lu writes, %lu blocks, %d dirty\n",
+         STATS_GET(flush_writes), STATS_GET(flush_blocks), mnt->dirty_count);
+  printf("readahead: %lu hits, %lu misses, %lu blocks prefetched\n",
+         STATS_GET(ra_hits), STATS_GET(ra_misses), STATS_GET(ra_prefetched));
+  printf("cache: %lu evictions, budget %d blocks\n",
+         STATS_GET(cache_evictions), cache_budget);
 
-int findFreeBlock() 
-{
-  int ret = -1;
+  printf("\n%-24s %8s %10s %8s\n", "helper", "calls", "avg scan", "max");
 
-  for (int i = 130; i < NUM_BLOCKS; i++)
+  for (int scan = 0; scan < NUM_SCANS; scan++)
   {
-    if (used_blocks[i] == 0)
+    struct scan_stats *sc = &scan_stats[scan];
+    unsigned long calls = STATS_GET(sc->calls);
+
+    if (calls == 0)
     {
-      ret = i;
-      break;
+      continue;
     }
-  }
 
-  return ret; 
+    printf("%-24s %8lu %10.1f %8lu\n", stats_scan_names[scan], calls,
+           (double) STATS_GET(sc->scanned) / calls, STATS_GET(sc->max));
+  }
 }
 
-int findFreeInodeBlockEntry (int inode_idx)
+//write every counter in the prometheus text format.  The histogram is
+//folded down to one bucket per power of two to keep the file small.
+void stats_write_prom (FILE *fp)
 {
-  int ret = -1;
+  fprintf(fp, "# TYPE mfs_ops_total counter\n");
+  for (int op = 0; op < NUM_OPS; op++)
+  {
+    fprintf(fp, "mfs_ops_total{op=\"%s\"} %lu\n", stats_op_names[op],
+            STATS_GET(op_stats[op].count));
+  }
 
-  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+  fprintf(fp, "# TYPE mfs_bytes_total counter\n");
+  for (int op = 0; op < NUM_OPS; op++)
   {
-    if (inode_array_ptr[inode_idx]->blocks[i] == -1)
+    fprintf(fp, "mfs_bytes_total{op=\"%s\"} %lu\n", stats_op_names[op],
+            STATS_GET(op_stats[op].bytes));
+  }
+
+  fprintf(fp, "# TYPE mfs_op_latency_seconds histogram\n");
+  for (int op = 0; op < NUM_OPS; op++)
+  {
+    struct op_stats *st = &op_stats[op];
+    unsigned long cumulative = 0;
+
+    for (int b = 0; b < STATS_BUCKETS; b++)
     {
-      ret = i;
-      break;
+      cumulative += STATS_GET(st->histogram[b]);
+      if (b % STATS_SUB_BUCKETS == STATS_SUB_BUCKETS - 1 && b / STATS_SUB_BUCKETS < 40)
+      {
+        fprintf(fp, "mfs_op_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %lu\n",
+                stats_op_names[op], stats_bucket_floor(b + 1) / 1e9, cumulative);
+      }
     }
+
+    fprintf(fp, "mfs_op_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n",
+            stats_op_names[op], cumulative);
+    fprintf(fp, "mfs_op_latency_seconds_sum{op=\"%s\"} %g\n", stats_op_names[op],
+            STATS_GET(st->total_ns) / 1e9);
+    fprintf(fp, "mfs_op_latency_seconds_count{op=\"%s\"} %lu\n", stats_op_names[op],
+            STATS_GET(st->count));
   }
 
-  return ret;
+  fprintf(fp, "# TYPE mfs_scan_calls_total counter\n");
+  for (int scan = 0; scan < NUM_SCANS; scan++)
+  {
+    fprintf(fp, "mfs_scan_calls_total{helper=\"%s\"} %lu\n", stats_scan_names[scan],
+            STATS_GET(scan_stats[scan].calls));
+  }
+
+  fprintf(fp, "# TYPE mfs_scan_entries_total counter\n");
+  for (int scan = 0; scan < NUM_SCANS; scan++)
+  {
+    fprintf(fp, "mfs_scan_entries_total{helper=\"%s\"} %lu\n", stats_scan_names[scan],
+            STATS_GET(scan_stats[scan].scanned));
+  }
 }
 
-int find_file_dir_idx (char *filename)
+//dump the stats to a temporary file and rename it over the target,
+//so a scraper never reads a half written file
+int stats_dump_prom (char *path)
 {
-  int ret = -1;
+  char tmp_path[PATH_MAX_LEN];
 
-  for (int i = 0; i < NUM_FILES; i++)
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *fp = fopen(tmp_path, "w");
+  if (fp == NULL)
   {
-    if (directory_ptr[i].name != NULL)
-    {
-      if (!strcmp(directory_ptr[i].name, filename))
-      {
-        ret = i;
-        break;
-      }
-    }
+    return -1;
   }
 
-  return ret;           
+  stats_write_prom(fp);
+  fclose(fp);
+
+  return rename(tmp_path, path);
 }
 
-int find_first_block_index (int inode_idx)
+void *stats_prom_loop (void *arg)
 {
-  int ret = -1;
+  (void) arg;
 
-  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+  while (__atomic_load_n(&stats_prom_running, __ATOMIC_RELAXED))
   {
-    if (inode_array_ptr[inode_idx]->blocks[i] != -1)
+    if (stats_dump_prom(stats_prom_path) == -1)
     {
-      ret = inode_array_ptr[inode_idx]->blocks[i];
-      break;
+      perror("stats: prometheus dump");
+    }
+
+    for (int i = 0; i < stats_prom_interval * 10 &&
+                    __atomic_load_n(&stats_prom_running, __ATOMIC_RELAXED); i++)
+    {
+      usleep(100000);
     }
   }
 
-  return ret;
+  return NULL;
 }
 
-int main()
+void stats_prom_stop()
 {
-  char * cmd_str = (char*) malloc( MAX_COMMAND_SIZE );
+  if (stats_prom_running)
+  {
+    __atomic_store_n(&stats_prom_running, 0, __ATOMIC_RELAXED);
+    pthread_join(stats_prom_thread, NULL);
+    free(stats_prom_path);
+    stats_prom_path = NULL;
+  }
+}
 
-  init();
+int stats_prom_start (char *path, int interval)
+{
+  stats_prom_stop();
 
-  while( 1 )
+  stats_prom_path = strdup(path);
+  stats_prom_interval = interval;
+  stats_prom_running = 1;
+
+  if (pthread_create(&stats_prom_thread, NULL, stats_prom_loop, NULL) != 0)
   {
-    // Print out the mfs prompt
-    printf ("mfs> ");
+    stats_prom_running = 0;
+    free(stats_prom_path);
+    stats_prom_path = NULL;
+    return -1;
+  }
 
-    // Read the command from the commandline.  The
-    // maximum command that will be read is MAX_COMMAND_SIZE
-    // This while command will wait here until the user
-    // inputs something since fgets returns NULL when there
-    // is no input
-    while( !fgets (cmd_str, MAX_COMMAND_SIZE, stdin) );
+  return 0;
+}
 
-    /* Parse input */
-    char *token[MAX_NUM_ARGUMENTS];
+// Workload recording.  While a recording is on, every command the
+// dispatcher handles is appended to the recording file as a
+// record_entry followed by the command line, without its newline.
+// start_ns counts from the start of the recording.  The file begins
+// with RECORD_MAGIC and RECORD_VERSION as two 32 bit words, and
+// mfs_replay reads it back.
+struct record_entry {
+  uint64_t start_ns;
+  uint32_t latency_ns;
+  uint16_t len;
+} __attribute__((packed));
+
+FILE *record_fp = NULL;
+unsigned long record_base_ns = 0;
+unsigned long record_cmd_ns = 0;
+char record_cmd[MAX_COMMAND_SIZE];
+int record_cmd_len = -1;
+
+int record_start (char *path)
+{
+  uint32_t header[2] = { RECORD_MAGIC, RECORD_VERSION };
 
-    int   token_count = 0;                                 
-                                                           
-    // Pointer to point to the token
-    // parsed by strsep
-    char *arg_ptr;                                         
-                                                           
-    char *working_str  = strdup( cmd_str );                
+  if (record_fp != NULL)
+  {
+    fclose(record_fp);
+  }
 
-    // we are going to move the working_str pointer so
-    // keep track of its original value so we can deallocate
-    // the correct amount at the end
-    char *working_root = working_str;
+  record_fp = fopen(path, "w");
+  if (record_fp == NULL)
+  {
+    return -1;
+  }
 
-    // Tokenize the input stringswith whitespace used as the delimiter
-    while ( ( (arg_ptr = strsep(&working_str, WHITESPACE ) ) != NULL) && 
-              (token_count<MAX_NUM_ARGUMENTS))
-    {
-      token[token_count] = strndup( arg_ptr, MAX_COMMAND_SIZE );
-      if( strlen( token[token_count] ) == 0 )
-      {
-        token[token_count] = NULL;
-      }
-        token_count++;
-    }
+  fwrite(header, sizeof(header), 1, record_fp);
+  record_base_ns = now_ns();
 
-    if ( cmd_str[0] == '\n' ) 
-    {
-      continue;
-    }
+  //the record command itself started before the new base
+  record_cmd_len = -1;
 
-    if (!strcmp(token[0], "quit"))
-    {
-      exit(0);
-    }
+  return 0;
+}
 
-    /*PUT*/
-    else if(!strcmp(token[0], "put"))
-    {
-      if (token[1] == NULL)
-      {
-        printf("Usage: put <filename>\n");
-        continue;
-      }
+void record_stop()
+{
+  if (record_fp != NULL)
+  {
+    fclose(record_fp);
+    record_fp = NULL;
+  }
+}
 
-      int status;                   // Hold the status of all return values.
-      struct stat buf;              // stat struct to hold the returns from the stat call
+//remember the command about to run.  put - reads its data from the
+//shell's input, which a replay could not feed it, so it is left out.
+void record_begin (char *cmd_str, char **token)
+{
+  if (record_fp == NULL ||
+      (!strcmp(token[0], "put") && token[1] != NULL && !strcmp(token[1], "-")))
+  {
+    record_cmd_len = -1;
+    return;
+  }
 
-      status = stat( token[1], &buf ); 
-      
-      //Verify that the file exists
-      if (status == -1)
-      {
-        printf("Unable to open file: %s\n", token[1] );
-        perror("Opening the input file returned");
-        continue;
-      }
+  record_cmd_len = strcspn(cmd_str, "\n");
+  memcpy(record_cmd, cmd_str, record_cmd_len);
+  record_cmd_ns = now_ns();
+}
 
-      //check the length of the file name.
-      if (strlen(token[1]) > MAX_FILE_NAME)
-      {
-        printf("put error: File name too long\n");
-        continue;
-      }
+//append the command record_begin saw, now that its latency is known
+void record_end()
+{
+  if (record_fp == NULL || record_cmd_len == -1)
+  {
+    return;
+  }
 
-      //Check if there is enough space
-      if (buf.st_size > df())
-      {
-        printf("put error: Not enough disk space\n");
-        continue;
-      }
+  unsigned long ns = now_ns() - record_cmd_ns;
+  struct record_entry entry;
 
-      int dir_idx = findFreeDirectoryEntry();
+  entry.start_ns = record_cmd_ns - record_base_ns;
+  entry.latency_ns = (ns > UINT32_MAX) ? UINT32_MAX : ns;
+  entry.len = record_cmd_len;
 
-      if (dir_idx == -1)
-      {
-        printf("Error: Not enough disk space\n");
-        continue;
-      }
+  fwrite(&entry, sizeof(entry), 1, record_fp);
+  fwrite(record_cmd, record_cmd_len, 1, record_fp);
 
-      directory_ptr[dir_idx].valid = 1; //used
+  record_cmd_len = -1;
+}
 
-      directory_ptr[dir_idx].name = (char *)malloc(strlen(token[1])); 
-      strcpy(directory_ptr[dir_idx].name, token[1]); //Copy file name
+// Tracepoints.  Built with -DMFS_TRACE every TRACE_END records one
+// complete event into the calling thread's ring buffer; without it the
+// macros expand to nothing and the arguments are never evaluated.  Each
+// ring has a single writer, its own thread, which publishes new events
+// by advancing head, so recording never takes a lock.  Readers never
+// store to head: clearing moves cleared_at up to it, and a dump drops any
+// slot the writer came round to again while it was being copied.
+#ifdef MFS_TRACE
+
+struct trace_event {
+  const char *name;
+  const char *arg0_name;
+  const char *arg1_name;
+  unsigned long start;
+  unsigned long duration;
+  long arg0;
+  long arg1;
+};
 
-      int inode_idx = findFreeInode();
+struct trace_ring {
+  unsigned long head;
+  unsigned long cleared_at;     // events before this index were cleared
+  int tid;
+  struct trace_event events[TRACE_RING_SIZE];
+};
 
-      if (inode_idx == -1)
-      {
-        printf("Error: No free inodes\n");
-        continue;
-      }
+struct trace_ring *trace_rings[TRACE_MAX_THREADS];
+int trace_ring_count = 0;
+__thread struct trace_ring *trace_ring_self = NULL;
+__thread int trace_ring_refused = 0;    // all rings were taken, stop trying
 
-      directory_ptr[dir_idx].inode_idx = inode_idx;
-      
-      inode_array_ptr[inode_idx]->valid = 1;
-      inode_array_ptr[inode_idx]->size = buf.st_size;
-      inode_array_ptr[inode_idx]->date = time(NULL); 
+// Slot fields are stored with release and loaded with acquire, so a
+// dump that saw a field of a newer event also sees the head before it
+#define TRACE_PUT(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define TRACE_GET(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
 
-      // Open the input file read-only 
-      FILE *ifp = fopen ( token[1], "r" ); 
-      printf("Reading %d bytes from %s\n", (int) buf . st_size, token[1] );
+void trace_record (const char *name, unsigned long start, const char *arg0_name,
+                   long arg0, const char *arg1_name, long arg1)
+{
+  struct trace_ring *ring = trace_ring_self;
 
-      int copy_size = buf.st_size;
-      int offset = 0;               
-  
-      // copy_size is initialized to the size of the input file so each loop iteration we
-      // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-      // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-      // we have copied all the data from the input file.
-      while( copy_size > 0 )
-      {
-        int block_index = findFreeBlock();
+  if (ring == NULL)
+  {
+    if (trace_ring_refused)
+    {
+      return;
+    }
 
-        if (block_index == -1)
-        {
-          printf("Error: No free blocks\n");
-          break;
-        }
+    int slot = __atomic_fetch_add(&trace_ring_count, 1, __ATOMIC_RELAXED);
+    if (slot >= TRACE_MAX_THREADS)
+    {
+      trace_ring_refused = 1;
+      return;
+    }
 
-        used_blocks[block_index] = 1;
+    ring = calloc(1, sizeof(struct trace_ring));
+    ring->tid = slot + 1;
+    trace_ring_self = ring;
+    __atomic_store_n(&trace_rings[slot], ring, __ATOMIC_RELEASE);
+  }
 
-        int inode_block_entry = findFreeInodeBlockEntry(inode_idx);
-        if (inode_block_entry == -1)
-        {
-          printf("Error: No free node blocks\n");
-          break;
-        }
+  unsigned long head = ring->head;
+  struct trace_event *ev = &ring->events[head & (TRACE_RING_SIZE - 1)];
 
-        inode_array_ptr[inode_idx]->blocks[inode_block_entry] = block_index;
+  TRACE_PUT(ev->name, name);
+  TRACE_PUT(ev->start, start);
+  TRACE_PUT(ev->duration, now_ns() - start);
+  TRACE_PUT(ev->arg0_name, arg0_name);
+  TRACE_PUT(ev->arg0, arg0);
+  TRACE_PUT(ev->arg1_name, arg1_name);
+  TRACE_PUT(ev->arg1, arg1);
 
-        // Index into the input file by offset number of bytes.  Initially offset is set to
-        // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-        // then increase the offset by BLOCK_SIZE and continue the process.  This will
-        // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-        fseek( ifp, offset, SEEK_SET );
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
 
-        int num_bytes;
+//write the events of every ring as chrome trace json, timestamps
+//and durations in microseconds
+int trace_dump (char *path)
+{
+  FILE *fp = fopen(path, "w");
+  int first = 1;
+  int events = 0;
 
-        // If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-        // only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
-        // end up with garbage at the end of the file.
-        if( copy_size < BLOCK_SIZE )
-        {
-          num_bytes = copy_size;
+  if (fp == NULL)
+  {
+    return -1;
+  }
+
+  fprintf(fp, "{\"traceEvents\":[\n");
+
+  int rings = __atomic_load_n(&trace_ring_count, __ATOMIC_RELAXED);
+  if (rings > TRACE_MAX_THREADS) rings = TRACE_MAX_THREADS;
+
+  for (int r = 0; r < rings; r++)
+  {
+    struct trace_ring *ring = __atomic_load_n(&trace_rings[r], __ATOMIC_ACQUIRE);
+    if (ring == NULL)
+    {
+      continue;
+    }
+
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+    unsigned long cleared = __atomic_load_n(&ring->cleared_at, __ATOMIC_ACQUIRE);
+
+    if (tail < cleared)
+    {
+      tail = cleared;
+    }
+
+    for (unsigned long i = tail; i < head; i++)
+    {
+      struct trace_event *slot = &ring->events[i & (TRACE_RING_SIZE - 1)];
+      struct trace_event ev;
+
+      ev.name = TRACE_GET(slot->name);
+      ev.start = TRACE_GET(slot->start);
+      ev.duration = TRACE_GET(slot->duration);
+      ev.arg0_name = TRACE_GET(slot->arg0_name);
+      ev.arg0 = TRACE_GET(slot->arg0);
+      ev.arg1_name = TRACE_GET(slot->arg1_name);
+      ev.arg1 = TRACE_GET(slot->arg1);
+
+      //the writer may have wrapped onto this slot while it was copied
+      if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= i + TRACE_RING_SIZE)
+      {
+        continue;
+      }
+
+      fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+              "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%ld,\"%s\":%ld}}",
+              first ? "" : ",\n", ev.name, (int) getpid(), ring->tid,
+              ev.start / 1000.0, ev.duration / 1000.0,
+              ev.arg0_name, ev.arg0, ev.arg1_name, ev.arg1);
+      first = 0;
+      events++;
+    }
+  }
+
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+
+  return events;
+}
+
+void trace_clear()
+{
+  int rings = __atomic_load_n(&trace_ring_count, __ATOMIC_RELAXED);
+  if (rings > TRACE_MAX_THREADS) rings = TRACE_MAX_THREADS;
+
+  for (int r = 0; r < rings; r++)
+  {
+    struct trace_ring *ring = __atomic_load_n(&trace_rings[r], __ATOMIC_ACQUIRE);
+    if (ring != NULL)
+    {
+      __atomic_store_n(&ring->cleared_at, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE),
+                       __ATOMIC_RELEASE);
+    }
+  }
+}
+
+#define TRACE_START(var) unsigned long var = now_ns()
+#define TRACE_END(name, var, a0_name, a0, a1_name, a1) \
+  trace_record(name, var, a0_name, (long) (a0), a1_name, (long) (a1))
+
+#else
+
+#define TRACE_START(var)
+#define TRACE_END(name, var, a0_name, a0, a1_name, a1)
+
+#endif
+
+void mark_dirty (int block)
+{
+  unsigned long bit = 1UL << (block % 64);
+
+  mnt->block_hashed[block] = 0;
+
+  if (!(mnt->dirty_bitmap[block / 64] & bit))
+  {
+    mnt->dirty_bitmap[block / 64] |= bit;
+    mnt->dirty_count++;
+  }
+}
+
+int is_dirty (int block)
+{
+  return (mnt->dirty_bitmap[block / 64] >> (block % 64)) & 1;
+}
+
+void clear_dirty (int block)
+{
+  if (is_dirty(block))
+  {
+    mnt->dirty_bitmap[block / 64] &= ~(1UL << (block % 64));
+    mnt->dirty_count--;
+  }
+}
+
+//first dirty block at or after block, -1 if there is none
+int next_dirty (int block)
+{
+  while (block < NUM_BLOCKS)
+  {
+    unsigned long word = mnt->dirty_bitmap[block / 64] >> (block % 64);
+
+    if (word != 0)
+    {
+      block += __builtin_ctzl(word);
+      return (block < NUM_BLOCKS) ? block : -1;
+    }
+
+    block = (block / 64 + 1) * 64;
+  }
+
+  return -1;
+}
+
+//the inode lives in the block after the directory
+void mark_inode_dirty (int inode_idx)
+{
+  mark_dirty(inode_idx + 1);
+}
+
+//number of blocks the inode currently maps
+int inode_block_count (int inode_idx)
+{
+  int count = 0;
+
+  while (count < MAX_BLOCKS_PER_FILE && mnt->inode_array_ptr[inode_idx]->blocks[count] != -1)
+  {
+    count++;
+  }
+
+  return count;
+}
+
+//write all of buf at offset, carrying on after short writes
+int pwrite_full (int fd, void *buf, size_t len, off_t offset)
+{
+  char *p = buf;
+
+  while (len > 0)
+  {
+    ssize_t n = pwrite(fd, p, len, offset);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+
+    p += n;
+    len -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+//read all of len bytes at offset, -1 on error or a short file
+int pread_full (int fd, void *buf, size_t len, off_t offset)
+{
+  char *p = buf;
+
+  while (len > 0)
+  {
+    ssize_t n = pread(fd, p, len, offset);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+
+    p += n;
+    len -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+//the descriptor block transfers to the image go through
+int image_data_fd()
+{
+  return (mnt->image_direct_fd != -1) ? mnt->image_direct_fd : mnt->image_fd;
+}
+
+//the descriptors block transfers to each member of the image go through
+void image_data_fds (int *fds)
+{
+  fds[0] = image_data_fd();
+
+  for (int m = 1; m < mnt->stripe_count; m++)
+  {
+    fds[m] = (mnt->stripe_direct_fd[m] != -1) ? mnt->stripe_direct_fd[m] : mnt->stripe_fd[m];
+  }
+}
+
+// One member's share of a block transfer on a striped image
+struct stripe_job {
+  pthread_t thread;
+  int fd;
+  int member;
+  int members;
+  int unit;
+  int write;
+  unsigned char *buf;
+  int block;
+  int count;
+  int status;
+};
+
+//move the pieces of the transfer that live on the job's member
+void *stripe_worker (void *arg)
+{
+  struct stripe_job *job = arg;
+  int end = job->block + job->count;
+
+  for (int b = job->block; b < end; )
+  {
+    int unit = b / job->unit;
+    int n = (unit + 1) * job->unit - b;
+
+    if (n > end - b)
+    {
+      n = end - b;
+    }
+
+    if (unit % job->members == job->member)
+    {
+      off_t offset = ((off_t) (unit / job->members) * job->unit + b % job->unit) * BLOCK_SIZE;
+      unsigned char *p = job->buf + (size_t) (b - job->block) * BLOCK_SIZE;
+
+      if ((job->write ? pwrite_full(job->fd, p, (size_t) n * BLOCK_SIZE, offset)
+                      : pread_full(job->fd, p, (size_t) n * BLOCK_SIZE, offset)) == -1)
+      {
+        job->status = -1;
+      }
+    }
+
+    b += n;
+  }
+
+  return NULL;
+}
+
+//read or write count blocks starting at block between buf and the
+//image, through the descriptors from image_data_fds.  On a striped
+//image a transfer spanning several members moves each member's share
+//on its own thread, so the members work in parallel.  Returns 0 or -1.
+int image_block_io (int *fds, int write, void *buf, int block, int count)
+{
+  if (mnt->stripe_count <= 1)
+  {
+    return write ? pwrite_full(fds[0], buf, (size_t) count * BLOCK_SIZE, (off_t) block * BLOCK_SIZE)
+                 : pread_full(fds[0], buf, (size_t) count * BLOCK_SIZE, (off_t) block * BLOCK_SIZE);
+  }
+
+  struct stripe_job jobs[MAX_STRIPES];
+  int members = mnt->stripe_count;
+  int first_unit = block / mnt->stripe_unit;
+  int spanned = (block + count - 1) / mnt->stripe_unit - first_unit + 1;
+  int started[MAX_STRIPES];
+  int inline_job = -1;
+  int status = 0;
+
+  for (int m = 0; m < members; m++)
+  {
+    jobs[m] = (struct stripe_job) { .fd = fds[m], .member = m, .members = members,
+                                    .unit = mnt->stripe_unit, .write = write, .buf = buf,
+                                    .block = block, .count = count, .status = 0 };
+    started[m] = 0;
+
+    //members the transfer has no unit on
+    if (spanned < members && (m - first_unit % members + members) % members >= spanned)
+    {
+      continue;
+    }
+
+    if (inline_job == -1)
+    {
+      inline_job = m;
+      continue;
+    }
+
+    started[m] = (pthread_create(&jobs[m].thread, NULL, stripe_worker, &jobs[m]) == 0);
+    if (!started[m])
+    {
+      stripe_worker(&jobs[m]);
+    }
+  }
+
+  stripe_worker(&jobs[inline_job]);
+
+  for (int m = 0; m < members; m++)
+  {
+    if (started[m])
+    {
+      pthread_join(jobs[m].thread, NULL);
+    }
+    if (jobs[m].status == -1)
+    {
+      status = -1;
+    }
+  }
+
+  return status;
+}
+
+//open a host file for direct I/O, -1 if the host file system refuses
+int open_direct (char *path, int flags)
+{
+  int fd = open(path, flags | O_DIRECT, 0644);
+
+  if (fd == -1 && errno == EINVAL)
+  {
+    printf("directio: %s does not support direct I/O, using buffered I/O\n", path);
+  }
+
+  return fd;
+}
+
+//read len bytes at an aligned offset into an aligned buffer.  The
+//transfer is rounded up to the alignment, which only the end of the
+//file can cut short, so the buffer must have room for the rounded
+//length.  Returns 0 or -1 if the file ended before len bytes.
+int pread_direct (int fd, void *buf, size_t len, off_t offset)
+{
+  size_t want = ALIGN_UP(len);
+  size_t got = 0;
+
+  while (got < len)
+  {
+    ssize_t n = pread(fd, (char *) buf + got, want - got, offset + got);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+
+    got += n;
+  }
+
+  return 0;
+}
+
+//write len bytes at an aligned offset from an aligned buffer.  The
+//aligned front goes out directly; an unaligned tail can only be the
+//end of the file and is written with O_DIRECT off for the one write.
+int pwrite_direct (int fd, void *buf, size_t len, off_t offset)
+{
+  size_t aligned = len / DIRECT_ALIGN * DIRECT_ALIGN;
+
+  if (aligned > 0 && pwrite_full(fd, buf, aligned, offset) == -1)
+  {
+    return -1;
+  }
+
+  if (aligned < len)
+  {
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) == -1)
+    {
+      return -1;
+    }
+
+    int status = pwrite_full(fd, (char *) buf + aligned, len - aligned, offset + aligned);
+
+    //the caller may go on writing through fd directly
+    if (fcntl(fd, F_SETFL, flags) == -1)
+    {
+      status = -1;
+    }
+
+    return status;
+  }
+
+  return 0;
+}
+
+//make sure the block's contents are in data_blocks, reading it from
+//the image if nothing has yet.  Returns 1 if it was already there.
+int block_load (int block)
+{
+  mnt->block_ref[block] = 1;
+
+  if (__atomic_load_n(&mnt->block_state[block], __ATOMIC_ACQUIRE) == BLOCK_LOADED)
+  {
+    return 1;
+  }
+
+  int hit = 1;
+
+  pthread_mutex_lock(&cache_lock);
+
+  while (mnt->block_state[block] == BLOCK_LOADING)
+  {
+    pthread_cond_wait(&block_loaded, &cache_lock);
+  }
+
+  if (mnt->block_state[block] == BLOCK_MISSING)
+  {
+    mnt->block_state[block] = BLOCK_LOADING;
+    pthread_mutex_unlock(&cache_lock);
+
+    TRACE_START(trace_start);
+
+    int fds[MAX_STRIPES];
+    image_data_fds(fds);
+
+    if (image_block_io(fds, 0, mnt->data_blocks[block], block, 1) == -1)
+    {
+      perror("Reading a block from the image returned");
+      memset(mnt->data_blocks[block], 0, BLOCK_SIZE);
+    }
+
+    TRACE_END("block_load", trace_start, "block", block, "sync", 1);
+
+    pthread_mutex_lock(&cache_lock);
+    __atomic_store_n(&mnt->block_state[block], BLOCK_LOADED, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&block_loaded);
+    hit = 0;
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+
+  return hit;
+}
+
+//a newly claimed block is about to be overwritten, so there is no
+//need to read it, but a prefetch still reading it has to finish first
+void block_claim (int block)
+{
+  mnt->block_ref[block] = 1;
+
+  if (__atomic_load_n(&mnt->block_state[block], __ATOMIC_ACQUIRE) == BLOCK_LOADED)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+
+  while (mnt->block_state[block] == BLOCK_LOADING)
+  {
+    pthread_cond_wait(&block_loaded, &cache_lock);
+  }
+
+  __atomic_store_n(&mnt->block_state[block], BLOCK_LOADED, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void *prefetch_loop (void *arg)
+{
+  mnt = (struct mount *) arg;
+
+  pthread_mutex_lock(&cache_lock);
+
+  while (mnt->prefetch_running)
+  {
+    if (mnt->prefetch_count == 0)
+    {
+      pthread_cond_wait(&mnt->prefetch_wake, &cache_lock);
+      continue;
+    }
+
+    int block = mnt->prefetch_queue[mnt->prefetch_head];
+    mnt->prefetch_head = (mnt->prefetch_head + 1) % PREFETCH_QUEUE;
+    mnt->prefetch_count--;
+
+    //claimed, loaded or already being read since it was queued
+    if (mnt->block_state[block] != BLOCK_MISSING)
+    {
+      continue;
+    }
+
+    //take the queued blocks that follow on in the image along too,
+    //so a contiguous file is prefetched with one read
+    int run = 1;
+    mnt->block_state[block] = BLOCK_LOADING;
+    while (mnt->prefetch_count > 0 && run < RA_MAX_WINDOW &&
+           mnt->prefetch_queue[mnt->prefetch_head] == block + run &&
+           mnt->block_state[block + run] == BLOCK_MISSING)
+    {
+      mnt->block_state[block + run] = BLOCK_LOADING;
+      mnt->prefetch_head = (mnt->prefetch_head + 1) % PREFETCH_QUEUE;
+      mnt->prefetch_count--;
+      run++;
+    }
+
+    mnt->prefetch_busy = 1;
+    pthread_mutex_unlock(&cache_lock);
+
+    TRACE_START(trace_start);
+
+    int fds[MAX_STRIPES];
+    image_data_fds(fds);
+
+    if (image_block_io(fds, 0, mnt->data_blocks[block], block, run) == -1)
+    {
+      memset(mnt->data_blocks[block], 0, (size_t) run * BLOCK_SIZE);
+    }
+
+    TRACE_END("prefetch", trace_start, "block", block, "blocks", run);
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = block; i < block + run; i++)
+    {
+      __atomic_store_n(&mnt->block_state[i], BLOCK_LOADED, __ATOMIC_RELEASE);
+    }
+    mnt->prefetch_busy = 0;
+    STATS_ADD(ra_prefetched, run);
+    pthread_cond_broadcast(&block_loaded);
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+
+  return NULL;
+}
+
+//drop everything still queued and wait for the read in flight, so the
+//image can be closed under the prefetch thread
+void prefetch_drain()
+{
+  pthread_mutex_lock(&cache_lock);
+
+  mnt->prefetch_count = 0;
+  while (mnt->prefetch_busy)
+  {
+    pthread_cond_wait(&block_loaded, &cache_lock);
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+//switch direct I/O for the image on or off.  Called with fs_lock held.
+void image_set_direct (int on)
+{
+  if (mnt->image_fd == -1)
+  {
+    return;
+  }
+
+  prefetch_drain();
+
+  if (on && mnt->image_direct_fd == -1)
+  {
+    mnt->image_direct_fd = open_direct(mnt->image_path, O_RDWR);
+  }
+  else if (!on && mnt->image_direct_fd != -1)
+  {
+    close(mnt->image_direct_fd);
+    mnt->image_direct_fd = -1;
+  }
+
+  for (int m = 1; m < mnt->stripe_count; m++)
+  {
+    if (on && mnt->stripe_direct_fd[m] == -1)
+    {
+      mnt->stripe_direct_fd[m] = open_direct(mnt->stripe_path[m], O_RDWR);
+    }
+    else if (!on && mnt->stripe_direct_fd[m] != -1)
+    {
+      close(mnt->stripe_direct_fd[m]);
+      mnt->stripe_direct_fd[m] = -1;
+    }
+  }
+}
+
+void prefetch_start()
+{
+  pthread_mutex_lock(&cache_lock);
+
+  if (!mnt->prefetch_running)
+  {
+    mnt->prefetch_running = 1;
+    if (pthread_create(&mnt->prefetch_thread, NULL, prefetch_loop, mnt) != 0)
+    {
+      mnt->prefetch_running = 0;
+    }
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+//stop the prefetch thread before its mount goes away
+void prefetch_stop()
+{
+  pthread_mutex_lock(&cache_lock);
+
+  if (!mnt->prefetch_running)
+  {
+    pthread_mutex_unlock(&cache_lock);
+    return;
+  }
+
+  mnt->prefetch_running = 0;
+  pthread_cond_signal(&mnt->prefetch_wake);
+  pthread_mutex_unlock(&cache_lock);
+
+  pthread_join(mnt->prefetch_thread, NULL);
+}
+
+//queue the file's block entries [from, to) for the prefetch thread
+void prefetch_entries (int inode_idx, int from, int to)
+{
+  int *blocks = mnt->inode_array_ptr[inode_idx]->blocks;
+
+  pthread_mutex_lock(&cache_lock);
+
+  if (!mnt->prefetch_running)
+  {
+    pthread_mutex_unlock(&cache_lock);
+    return;
+  }
+
+  for (int i = from; i < to && i < MAX_BLOCKS_PER_FILE && blocks[i] != -1; i++)
+  {
+    if (mnt->block_state[blocks[i]] == BLOCK_MISSING && mnt->prefetch_count < PREFETCH_QUEUE)
+    {
+      mnt->prefetch_queue[(mnt->prefetch_head + mnt->prefetch_count) % PREFETCH_QUEUE] = blocks[i];
+      mnt->prefetch_count++;
+    }
+  }
+
+  pthread_cond_signal(&mnt->prefetch_wake);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+//count an access to a block of a file
+void heat_touch (int inode_idx, int block)
+{
+  if (mnt->block_heat[block] < HEAT_MAX)
+  {
+    mnt->block_heat[block]++;
+  }
+
+  if (mnt->file_heat[inode_idx] < UINT32_MAX)
+  {
+    mnt->file_heat[inode_idx]++;
+  }
+}
+
+//halve every access counter of the current mount
+void heat_decay()
+{
+  for (int b = 130; b < NUM_BLOCKS; b++)
+  {
+    mnt->block_heat[b] >>= 1;
+  }
+
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    mnt->file_heat[i] >>= 1;
+  }
+}
+
+//load the file's block entry for reading, and adjust the readahead
+//window by whether the read follows on from the previous one
+void block_read_access (int inode_idx, int entry)
+{
+  heat_touch(inode_idx, mnt->inode_array_ptr[inode_idx]->blocks[entry]);
+
+  //a read from the start is a new pass over the file
+  if (entry == 0)
+  {
+    mnt->ra_issued[inode_idx] = 1;
+  }
+
+  if (entry == mnt->ra_next[inode_idx])
+  {
+    if (mnt->ra_window[inode_idx] == 0)
+    {
+      mnt->ra_window[inode_idx] = RA_INITIAL_WINDOW;
+    }
+    else if (mnt->ra_window[inode_idx] < RA_MAX_WINDOW)
+    {
+      mnt->ra_window[inode_idx] *= 2;
+    }
+  }
+  else
+  {
+    mnt->ra_window[inode_idx] /= 2;
+    mnt->ra_issued[inode_idx] = entry + 1;
+  }
+
+  mnt->ra_next[inode_idx] = entry + 1;
+
+  if (mnt->image_fd != -1 && mnt->ra_window[inode_idx] > 0)
+  {
+    int from = (mnt->ra_issued[inode_idx] > entry + 1) ? mnt->ra_issued[inode_idx] : entry + 1;
+    int to = entry + 1 + mnt->ra_window[inode_idx];
+    int count = inode_block_count(inode_idx);
+
+    if (to > count)
+    {
+      to = count;
+    }
+
+    if (from < to)
+    {
+      prefetch_entries(inode_idx, from, to);
+      mnt->ra_issued[inode_idx] = to;
+    }
+  }
+
+  if (block_load(mnt->inode_array_ptr[inode_idx]->blocks[entry]))
+  {
+    STATS_ADD(ra_hits, 1);
+  }
+  else
+  {
+    STATS_ADD(ra_misses, 1);
+  }
+}
+
+int extent_class (int len)
+{
+  int c = 0;
+
+  while ((2 << c) <= len && c < EXTENT_CLASSES - 1)
+  {
+    c++;
+  }
+
+  return c;
+}
+
+void extent_link (int start, int len)
+{
+  int c = extent_class(len);
+
+  mnt->extent_len[start] = len;
+  mnt->extent_first[start + len - 1] = start;
+  mnt->extent_prev[start] = -1;
+  mnt->extent_next[start] = mnt->extent_head[c];
+  if (mnt->extent_head[c] != -1)
+  {
+    mnt->extent_prev[mnt->extent_head[c]] = start;
+  }
+  mnt->extent_head[c] = start;
+}
+
+void extent_unlink (int start)
+{
+  int len = mnt->extent_len[start];
+
+  if (mnt->extent_prev[start] != -1)
+  {
+    mnt->extent_next[mnt->extent_prev[start]] = mnt->extent_next[start];
+  }
+  else
+  {
+    mnt->extent_head[extent_class(len)] = mnt->extent_next[start];
+  }
+
+  if (mnt->extent_next[start] != -1)
+  {
+    mnt->extent_prev[mnt->extent_next[start]] = mnt->extent_prev[start];
+  }
+
+  mnt->extent_len[start] = 0;
+  mnt->extent_first[start + len - 1] = -1;
+}
+
+//rebuild the free extent lists from used_blocks
+void extent_rebuild()
+{
+  for (int c = 0; c < EXTENT_CLASSES; c++)
+  {
+    mnt->extent_head[c] = -1;
+  }
+
+  for (int i = 0; i < NUM_BLOCKS; i++)
+  {
+    mnt->extent_len[i] = 0;
+    mnt->extent_first[i] = -1;
+  }
+
+  mnt->free_blocks = 0;
+
+  int i = 130;
+  while (i < NUM_BLOCKS)
+  {
+    if (mnt->used_blocks[i] != 0)
+    {
+      i++;
+      continue;
+    }
+
+    int start = i;
+    while (i < NUM_BLOCKS && mnt->used_blocks[i] == 0)
+    {
+      i++;
+    }
+
+    extent_link(start, i - start);
+    mnt->free_blocks += i - start;
+  }
+}
+
+//claim count blocks at the front of the free run starting at start
+void extent_take (int start, int count)
+{
+  int len = mnt->extent_len[start];
+
+  extent_unlink(start);
+  if (len > count)
+  {
+    extent_link(start + count, len - count);
+  }
+
+  for (int i = start; i < start + count; i++)
+  {
+    mnt->used_blocks[i] = 1;
+    mnt->block_heat[i] = 0;
+    block_claim(i);
+  }
+
+  mnt->free_blocks -= count;
+}
+
+//claim the best fitting run of count free blocks.  The size class of
+//count is searched for the smallest run that fits, any run in a larger
+//class fits as is.  Returns the first block or -1 if no run is long enough.
+int extent_alloc_run (int count)
+{
+  TRACE_START(trace_start);
+
+  if (count < 1 || count > mnt->free_blocks)
+  {
+    TRACE_END("extent_alloc_run", trace_start, "count", count, "block", -1);
+    return -1;
+  }
+
+  int best = -1;
+  int scanned = 0;
+  int c = extent_class(count);
+
+  for (int b = mnt->extent_head[c]; b != -1; b = mnt->extent_next[b])
+  {
+    scanned++;
+    if (mnt->extent_len[b] >= count && (best == -1 || mnt->extent_len[b] < mnt->extent_len[best]))
+    {
+      best = b;
+      if (mnt->extent_len[b] == count) break;
+    }
+  }
+
+  stats_scan(SCAN_EXTENT_LIST, scanned);
+
+  for (c = c + 1; best == -1 && c < EXTENT_CLASSES; c++)
+  {
+    best = mnt->extent_head[c];
+  }
+
+  if (best == -1)
+  {
+    TRACE_END("extent_alloc_run", trace_start, "count", count, "block", -1);
+    return -1;
+  }
+
+  extent_take(best, count);
+
+  TRACE_END("extent_alloc_run", trace_start, "count", count, "block", best);
+
+  return best;
+}
+
+//claim the longest free run, but no more than count blocks of it.
+//Returns the first block and sets *got to the number claimed.
+int extent_alloc_longest (int count, int *got)
+{
+  TRACE_START(trace_start);
+
+  for (int c = EXTENT_CLASSES - 1; c >= 0; c--)
+  {
+    int best = -1;
+
+    for (int b = mnt->extent_head[c]; b != -1; b = mnt->extent_next[b])
+    {
+      if (best == -1 || mnt->extent_len[b] > mnt->extent_len[best])
+      {
+        best = b;
+      }
+    }
+
+    if (best != -1)
+    {
+      *got = (mnt->extent_len[best] < count) ? mnt->extent_len[best] : count;
+      extent_take(best, *got);
+      TRACE_END("extent_alloc_longest", trace_start, "count", *got, "block", best);
+      return best;
+    }
+  }
+
+  *got = 0;
+  TRACE_END("extent_alloc_longest", trace_start, "count", 0, "block", -1);
+  return -1;
+}
+
+//drop one reference to a block.  The last reference gives it back to
+//the allocator, merging it with free neighbours.
+void release_block (int block)
+{
+  if (mnt->used_blocks[block] > 1)
+  {
+    mnt->used_blocks[block]--;
+    mnt->pack_sparse |= mnt->pack_blocks[block];
+    return;
+  }
+
+  if (block == mnt->pack_block)
+  {
+    mnt->pack_block = -1;
+  }
+  mnt->pack_blocks[block] = 0;
+
+  TRACE_START(trace_start);
+  int start = block;
+  int len = 1;
+
+  mnt->used_blocks[block] = 0;
+  mnt->free_blocks++;
+
+  if (block > 130 && mnt->extent_first[block - 1] != -1)
+  {
+    start = mnt->extent_first[block - 1];
+    len += mnt->extent_len[start];
+    extent_unlink(start);
+  }
+
+  if (block + 1 < NUM_BLOCKS && mnt->extent_len[block + 1] != 0)
+  {
+    len += mnt->extent_len[block + 1];
+    extent_unlink(block + 1);
+  }
+
+  extent_link(start, len);
+
+  TRACE_END("release_block", trace_start, "block", block, "run", len);
+}
+
+void *arena_alloc (struct arena *a, size_t size)
+{
+  size = (size + 7) & ~(size_t) 7;
+
+  if (a->used + size > a->size)
+  {
+    return NULL;
+  }
+
+  void *p = a->base + a->used;
+  a->used += size;
+  return p;
+}
+
+char *arena_strndup (struct arena *a, const char *s, size_t max)
+{
+  size_t len = strnlen(s, max);
+  char *copy = arena_alloc(a, len + 1);
+
+  if (copy != NULL)
+  {
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+void arena_reset (struct arena *a)
+{
+  a->used = 0;
+}
+
+//copy a name of at most MAX_FILE_NAME characters into a slab slot
+char *name_dup (const char *name)
+{
+  if (name_free_list == NULL)
+  {
+    union name_slot *slots = malloc(NAME_SLAB_SLOTS * sizeof(union name_slot));
+
+    if (slots == NULL)
+    {
+      return NULL;
+    }
+
+    for (int i = 0; i < NAME_SLAB_SLOTS; i++)
+    {
+      slots[i].next = name_free_list;
+      name_free_list = &slots[i];
+    }
+  }
+
+  union name_slot *slot = name_free_list;
+  name_free_list = slot->next;
+
+  snprintf(slot->name, sizeof(slot->name), "%.*s", MAX_FILE_NAME, name);
+  return slot->name;
+}
+
+void name_free (char *name)
+{
+  if (name == NULL)
+  {
+    return;
+  }
+
+  union name_slot *slot = (union name_slot *) name;
+  slot->next = name_free_list;
+  name_free_list = slot;
+}
+
+void init()
+{
+  mnt->directory_ptr = (struct directory_entry *) &mnt->data_blocks[0];
+
+  for (int i = 0; i < NUM_FILES; i++)
+  {
+    mnt->directory_ptr[i].name = NULL;
+    mnt->directory_ptr[i].valid = 0; 
+    mnt->directory_ptr[i].hidden = 0;
+    mnt->directory_ptr[i].read_only = 0;
+  }
+
+  int inode_idx = 0;
+  for (int i = 1; i <= NUM_INODES; i++)
+  {
+    mnt->inode_array_ptr[inode_idx++] = (struct inode *) &mnt->data_blocks[i];
+  }
+
+  for (int i = 0; i < 130; i++)
+  {
+    mnt->used_blocks[i] = 1;
+  }
+  for (int i = 130; i < NUM_BLOCKS; i++)
+  {
+    mnt->used_blocks[i] = 0;
+  }
+
+  extent_rebuild();
+
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    for (int j = 0; j < MAX_BLOCKS_PER_FILE; j++)
+    {
+      mnt->inode_array_ptr[i]->blocks[j] = -1;
+    }
+    mnt->inode_array_ptr[i]->valid = 0;
+    mnt->tombstones[i].name = NULL;
+  }
+
+  mnt->tombstone_head = -1;
+  mnt->tombstone_tail = -1;
+  mnt->reclaimable_blocks = 0;
+
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    mnt->inode_array_ptr[i]->packed = 0;
+    mnt->inode_array_ptr[i]->pack_offset = 0;
+  }
+
+  mnt->pack_block = -1;
+  memset(mnt->pack_blocks, 0, sizeof(mnt->pack_blocks));
+
+  //a new file system has nothing to read from an image
+  memset(mnt->block_state, BLOCK_LOADED, sizeof(mnt->block_state));
+
+  for (int i = 0; i < 130; i++)
+  {
+    mark_dirty(i);
+  }
+}
+
+int df() 
+{
+  return mnt->free_blocks * BLOCK_SIZE; 
+}
+
+//space held by deleted files that can still be undeleted
+int df_reclaimable()
+{
+  return mnt->reclaimable_blocks * BLOCK_SIZE;
+}
+
+void tombstone_unlink (int inode_idx)
+{
+  struct tombstone *t = &mnt->tombstones[inode_idx];
+
+  if (t->prev != -1) mnt->tombstones[t->prev].next = t->next;
+  else mnt->tombstone_head = t->next;
+
+  if (t->next != -1) mnt->tombstones[t->next].prev = t->prev;
+  else mnt->tombstone_tail = t->prev;
+
+  t->name = NULL;
+}
+
+//move a deleted file's inode to the tail of the tombstone list
+void tombstone_add (int dir_idx)
+{
+  int inode_idx = mnt->directory_ptr[dir_idx].inode_idx;
+  struct tombstone *t = &mnt->tombstones[inode_idx];
+
+  t->name = mnt->directory_ptr[dir_idx].name;
+  t->hidden = mnt->directory_ptr[dir_idx].hidden;
+  t->read_only = mnt->directory_ptr[dir_idx].read_only;
+  t->next = -1;
+  t->prev = mnt->tombstone_tail;
+
+  if (mnt->tombstone_tail != -1) mnt->tombstones[mnt->tombstone_tail].next = inode_idx;
+  else mnt->tombstone_head = inode_idx;
+  mnt->tombstone_tail = inode_idx;
+
+  mnt->reclaimable_blocks += inode_block_count(inode_idx);
+}
+
+//an inode whose blocks are still held, by a live, staged or deleted file
+int inode_in_use (int inode_idx)
+{
+  return mnt->inode_array_ptr[inode_idx]->valid != 0 || mnt->tombstones[inode_idx].name != NULL;
+}
+
+//permanently delete the tombstoned file, giving its blocks back
+void reclaim_tombstone (int inode_idx)
+{
+  int *blocks = mnt->inode_array_ptr[inode_idx]->blocks;
+
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE && blocks[i] != -1; i++)
+  {
+    release_block(blocks[i]);
+    blocks[i] = -1;
+    mnt->reclaimable_blocks--;
+  }
+  mnt->inode_array_ptr[inode_idx]->packed = 0;
+
+  name_free(mnt->tombstones[inode_idx].name);
+  tombstone_unlink(inode_idx);
+  mark_inode_dirty(inode_idx);
+}
+
+//reclaim the oldest deletions until at least count blocks are free
+void reclaim_blocks (int count)
+{
+  while (mnt->free_blocks < count && mnt->tombstone_head != -1)
+  {
+    reclaim_tombstone(mnt->tombstone_head);
+  }
+}
+
+//find the newest tombstone with the given name
+int find_tombstone (char *filename)
+{
+  for (int i = mnt->tombstone_tail; i != -1; i = mnt->tombstones[i].prev)
+  {
+    if (!strcmp(mnt->tombstones[i].name, filename))
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+int findFreeDirectoryEntry() 
+{
+  TRACE_START(trace_start);
+  int ret = -1;
+
+  for (int i = 0; i < NUM_FILES; i++)
+  {
+    if (mnt->directory_ptr[i].valid == 0)
+    {
+      ret = i;
+      break;
+    }
+  }
+
+  stats_scan(SCAN_FREE_DIR, (ret == -1) ? NUM_FILES : ret + 1);
+  TRACE_END("findFreeDirectoryEntry", trace_start, "slot", ret, "scanned",
+            (ret == -1) ? NUM_FILES : ret + 1);
+
+  return ret;
+}
+
+int findFreeInode()
+{
+  TRACE_START(trace_start);
+  int ret = -1;
+
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    if (mnt->inode_array_ptr[i]->valid == 0 && mnt->tombstones[i].name == NULL)
+    {
+      ret = i;
+      break;
+    }
+  }
+
+  stats_scan(SCAN_FREE_INODE, (ret == -1) ? NUM_INODES : ret + 1);
+
+  //every free inode still holds a deleted file, give up the oldest one
+  if (ret == -1 && mnt->tombstone_head != -1)
+  {
+    ret = mnt->tombstone_head;
+    reclaim_tombstone(ret);
+  }
+
+  if (ret != -1)
+  {
+    mnt->file_heat[ret] = 0;
+    mnt->inode_array_ptr[ret]->packed = 0;
+    mnt->inode_array_ptr[ret]->pack_offset = 0;
+  }
+
+  TRACE_END("findFreeInode", trace_start, "inode", ret, "free_blocks", mnt->free_blocks);
+
+  return ret;
+}
+
+int findFreeBlock() 
+{
+  int ret = -1;
+
+  for (int i = 130; i < NUM_BLOCKS; i++)
+  {
+    if (mnt->used_blocks[i] == 0)
+    {
+      ret = i;
+      break;
+    }
+  }
+
+  stats_scan(SCAN_FREE_BLOCK, (ret == -1) ? NUM_BLOCKS - 130 : ret - 129);
+
+  return ret; 
+}
+
+int findFreeInodeBlockEntry (int inode_idx)
+{
+  int ret = -1;
+
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+  {
+    if (mnt->inode_array_ptr[inode_idx]->blocks[i] == -1)
+    {
+      ret = i;
+      break;
+    }
+  }
+
+  return ret;
+}
+
+//claim one block for a file that is growing one block at a time.
+//The block right after prev is taken when it is free so the file
+//stays contiguous, otherwise the block comes from the longest free run
+//so the file has the most room to keep growing.  Returns -1 when full.
+int alloc_block_after (int prev)
+{
+  int got;
+
+  if (mnt->free_blocks == 0)
+  {
+    reclaim_blocks(1);
+  }
+
+  if (prev != -1 && prev + 1 < NUM_BLOCKS && mnt->extent_len[prev + 1] != 0)
+  {
+    extent_take(prev + 1, 1);
+    return prev + 1;
+  }
+
+  return extent_alloc_longest(1, &got);
+}
+
+//make sure the inode's block at entry is its own before it is written.
+//A block shared with other inodes is replaced by a copy, which only
+//needs the old contents when the write will not cover the whole block.
+//When it will, the block is claimed so the image copy is never loaded
+//over the new bytes.  Returns the block to write to or -1 when there is
+//no block to copy to.
+int block_unshare (int inode_idx, int entry, int whole)
+{
+  int *blocks = mnt->inode_array_ptr[inode_idx]->blocks;
+  int block = blocks[entry];
+
+  //reclaiming may drop the last other reference, so it goes first
+  if (mnt->used_blocks[block] > 1 && mnt->free_blocks == 0)
+  {
+    reclaim_blocks(1);
+  }
+
+  if (mnt->used_blocks[block] < 2)
+  {
+    if (whole)
+    {
+      block_claim(block);
+    }
+    return block;
+  }
+
+  int copy = alloc_block_after((entry > 0) ? blocks[entry - 1] : -1);
+
+  if (copy == -1)
+  {
+    return -1;
+  }
+
+  if (whole)
+  {
+    block_claim(copy);
+  }
+  else
+  {
+    block_load(block);
+    memcpy(mnt->data_blocks[copy], mnt->data_blocks[block], BLOCK_SIZE);
+  }
+
+  mnt->used_blocks[block]--;
+  blocks[entry] = copy;
+  mark_dirty(copy);
+  mark_inode_dirty(inode_idx);
+
+  return copy;
+}
+
+//number of blocks in the file's byte range [offset, end) that other
+//inodes share, each of which a write there has to copy first
+int count_shared_blocks (int inode_idx, int offset, int end)
+{
+  struct inode *inode = mnt->inode_array_ptr[inode_idx];
+  int shared = 0;
+
+  if (end > inode->size)
+  {
+    end = inode->size;
+  }
+
+  for (int e = offset / BLOCK_SIZE; offset < end && e <= (end - 1) / BLOCK_SIZE; e++)
+  {
+    if (mnt->used_blocks[inode->blocks[e]] > 1)
+    {
+      shared++;
+    }
+  }
+
+  return shared;
+}
+
+//map count new blocks into the inode, in as few runs as possible.
+//A single run sized to the whole file is preferred, otherwise the
+//longest runs are used first.  Returns 0 or -1 if the space ran out.
+int alloc_file_blocks (int inode_idx, int count)
+{
+  int entry = findFreeInodeBlockEntry(inode_idx);
+
+  if (entry == -1 || entry + count > MAX_BLOCKS_PER_FILE || count > mnt->free_blocks)
+  {
+    return -1;
+  }
+
+  int start = extent_alloc_run(count);
+  if (start != -1)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      mnt->inode_array_ptr[inode_idx]->blocks[entry++] = start + i;
+    }
+    return 0;
+  }
+
+  while (count > 0)
+  {
+    int got;
+
+    start = extent_alloc_longest(count, &got);
+    for (int i = 0; i < got; i++)
+    {
+      mnt->inode_array_ptr[inode_idx]->blocks[entry++] = start + i;
+    }
+    count -= got;
+  }
+
+  return 0;
+}
+
+int find_file_dir_idx (char *filename)
+{
+  TRACE_START(trace_start);
+  int ret = -1;
+
+  for (int i = 0; i < NUM_FILES; i++)
+  {
+    if (mnt->directory_ptr[i].name != NULL && mnt->directory_ptr[i].valid == 1)
+    {
+      if (!strcmp(mnt->directory_ptr[i].name, filename))
+      {
+        ret = i;
+        break;
+      }
+    }
+  }
+
+  stats_scan(SCAN_FILE_DIR_IDX, (ret == -1) ? NUM_FILES : ret + 1);
+  TRACE_END("find_file_dir_idx", trace_start, "slot", ret, "scanned",
+            (ret == -1) ? NUM_FILES : ret + 1);
+
+  return ret;           
+}
+
+int find_first_block_index (int inode_idx)
+{
+  int ret = -1;
+
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+  {
+    if (mnt->inode_array_ptr[inode_idx]->blocks[i] != -1)
+    {
+      ret = mnt->inode_array_ptr[inode_idx]->blocks[i];
+      break;
+    }
+  }
+
+  return ret;
+}
+
+//number of contiguous runs the file's blocks are split into
+int count_file_extents (int inode_idx)
+{
+  int *blocks = mnt->inode_array_ptr[inode_idx]->blocks;
+  int extents = 0;
+
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE && blocks[i] != -1; i++)
+  {
+    if (i == 0 || blocks[i] != blocks[i - 1] + 1)
+    {
+      extents++;
+    }
+  }
+
+  return extents;
+}
+
+//move a fragmented file into the best fitting free run.  The new copy is
+//complete before the inode is switched over, so the file is readable
+//through the whole move.  Returns the number of blocks moved.
+int defrag_file (int inode_idx)
+{
+  struct inode *inode = mnt->inode_array_ptr[inode_idx];
+  int count = inode_block_count(inode_idx);
+
+  if (count < 2 || count_file_extents(inode_idx) == 1)
+  {
+    return 0;
+  }
+
+  //moving shared blocks would unshare them and use more space
+  for (int i = 0; i < count; i++)
+  {
+    if (mnt->used_blocks[inode->blocks[i]] > 1)
+    {
+      return 0;
+    }
+  }
+
+  int start = extent_alloc_run(count);
+  if (start == -1)
+  {
+    return 0;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    block_load(inode->blocks[i]);
+    memcpy(mnt->data_blocks[start + i], mnt->data_blocks[inode->blocks[i]], BLOCK_SIZE);
+    mark_dirty(start + i);
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    int old_block = inode->blocks[i];
+    inode->blocks[i] = start + i;
+    release_block(old_block);
+  }
+
+  mark_inode_dirty(inode_idx);
+
+  return count;
+}
+
+//print the free extent histogram and the extent count of every
+//file that is split into more than one run
+void frag_report()
+{
+  int histogram[FRAG_BUCKETS] = {0};
+  int free_extents = 0;
+  int largest = 0;
+  int i = 130;
+
+  while (i < NUM_BLOCKS)
+  {
+    if (mnt->used_blocks[i] != 0)
+    {
+      i++;
+      continue;
+    }
+
+    int start = i;
+    while (i < NUM_BLOCKS && mnt->used_blocks[i] == 0)
+    {
+      i++;
+    }
+
+    int len = i - start;
+    int bucket = 0;
+    while ((2 << bucket) <= len && bucket < FRAG_BUCKETS - 1)
+    {
+      bucket++;
+    }
+
+    histogram[bucket]++;
+    free_extents++;
+    if (len > largest) largest = len;
+  }
+
+  printf("Free extents: %d, largest %d blocks\n", free_extents, largest);
+  for (int b = 0; b < FRAG_BUCKETS; b++)
+  {
+    if (histogram[b] > 0)
+    {
+      printf("  %5d - %5d blocks: %d\n", 1 << b, (2 << b) - 1, histogram[b]);
+    }
+  }
+
+  int files = 0;
+  int fragmented = 0;
+  for (int d = 0; d < NUM_FILES; d++)
+  {
+    if (mnt->directory_ptr[d].valid == 1)
+    {
+      int extents = count_file_extents(mnt->directory_ptr[d].inode_idx);
+
+      files++;
+      if (extents > 1)
+      {
+        fragmented++;
+        printf("  %-32s %d extents\n", mnt->directory_ptr[d].name, extents);
+      }
+    }
+  }
+
+  printf("Fragmented files: %d of %d\n", fragmented, files);
+
+  int pack_blocks = 0;
+  int packed = 0;
+  for (int b = 130; b < NUM_BLOCKS; b++)
+  {
+    pack_blocks += mnt->pack_blocks[b];
+  }
+  for (int n = 0; n < NUM_INODES; n++)
+  {
+    if (inode_in_use(n) && mnt->inode_array_ptr[n]->packed)
+    {
+      packed++;
+    }
+  }
+
+  printf("Packed files: %d in %d blocks\n", packed, pack_blocks);
+}
+
+//compare two directory entries by the given sort key,
+//falling back to the name so the order is always total
+int list_compare (int key, int a, int b)
+{
+  struct inode *ia = mnt->inode_array_ptr[mnt->directory_ptr[a].inode_idx];
+  struct inode *ib = mnt->inode_array_ptr[mnt->directory_ptr[b].inode_idx];
+
+  if (key == LIST_SORT_SIZE && ia->size != ib->size)
+  {
+    return (ia->size < ib->size) ? -1 : 1;
+  }
+
+  if (key == LIST_SORT_DATE && ia->date != ib->date)
+  {
+    return (ia->date < ib->date) ? -1 : 1;
+  }
+
+  return strcmp(mnt->directory_ptr[a].name, mnt->directory_ptr[b].name);
+}
+
+void list_index_remove (int dir_idx)
+{
+  for (int key = 0; key < 3; key++)
+  {
+    int *index = mnt->list_index[key];
+
+    for (int i = 0; i < mnt->list_index_count; i++)
+    {
+      if (index[i] == dir_idx)
+      {
+        memmove(&index[i], &index[i + 1], (mnt->list_index_count - i - 1) * sizeof(int));
+        break;
+      }
+    }
+  }
+
+  mnt->list_index_count--;
+}
+
+void list_index_insert (int dir_idx)
+{
+  int inode_idx = mnt->directory_ptr[dir_idx].inode_idx;
+  time_t date = mnt->inode_array_ptr[inode_idx]->date;
+
+  strftime(mnt->inode_date_str[inode_idx], LIST_DATE_SIZE, "%a %b %e %H:%M:%S %Y",
+           localtime(&date));
+
+  for (int key = 0; key < 3; key++)
+  {
+    int *index = mnt->list_index[key];
+
+    //binary search for the insertion point
+    int lo = 0;
+    int hi = mnt->list_index_count;
+    while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (list_compare(key, index[mid], dir_idx) < 0)
+      {
+        lo = mid + 1;
+      }
+      else
+      {
+        hi = mid;
+      }
+    }
+
+    memmove(&index[lo + 1], &index[lo], (mnt->list_index_count - lo) * sizeof(int));
+    index[lo] = dir_idx;
+  }
+
+  mnt->list_index_count++;
+}
+
+//re-sort an entry whose size or date changed
+void list_index_update (int dir_idx)
+{
+  list_index_remove(dir_idx);
+  list_index_insert(dir_idx);
+}
+
+//format the requested page of the listing into one buffer and
+//write it out with a single call
+void list_files (int key, int reverse, char *pattern, int page, int page_size)
+{
+  static char out[NUM_FILES * LIST_LINE_SIZE];
+  int len = 0;
+  int matched = 0;
+  int first = (page > 0) ? (page - 1) * page_size : 0;
+
+  for (int n = 0; n < mnt->list_index_count; n++)
+  {
+    int i = mnt->list_index[key][reverse ? mnt->list_index_count - n - 1 : n];
+
+    if (mnt->directory_ptr[i].hidden == 1)
+    {
+      continue;
+    }
+
+    if (pattern != NULL && fnmatch(pattern, mnt->directory_ptr[i].name, 0) != 0)
+    {
+      continue;
+    }
+
+    matched++;
+
+    if (matched <= first || (page > 0 && matched > first + page_size))
+    {
+      continue;
+    }
+
+    int inode_idx = mnt->directory_ptr[i].inode_idx;
+
+    len += snprintf(out + len, sizeof(out) - len, "%5d  %5s  %5s\n",
+                    mnt->inode_array_ptr[inode_idx]->size, mnt->inode_date_str[inode_idx],
+                    mnt->directory_ptr[i].name);
+  }
+
+  if (matched == 0)
+  {
+    len = snprintf(out, sizeof(out), "list: No files found\n");
+  }
+  else if (page > 0)
+  {
+    int pages = (matched + page_size - 1) / page_size;
+    len += snprintf(out + len, sizeof(out) - len, "-- page %d of %d (%d files) --\n",
+                    page, pages, matched);
+  }
+
+  fflush(stdout);
+  if (write(STDOUT_FILENO, out, len) != len)
+  {
+    perror("list: write");
+  }
+}
+
+//number of worker threads fsck splits its passes across
+int fsck_threads()
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n < 1) return 1;
+  if (n > FSCK_MAX_THREADS) return FSCK_MAX_THREADS;
+  return n;
+}
+
+//run worker over [first, last) split into one contiguous slice per
+//thread.  A slice whose thread can not be started runs here instead.
+//Returns the number of problems the workers found.
+int fsck_parallel (void *(*worker)(void *), int first, int last)
+{
+  struct fsck_job jobs[FSCK_MAX_THREADS];
+  int started[FSCK_MAX_THREADS];
+  int threads = fsck_threads();
+  int per = (last - first + threads - 1) / threads;
+  int problems = 0;
+
+  for (int t = 0; t < threads; t++)
+  {
+    jobs[t].first = first + t * per;
+    jobs[t].last = (jobs[t].first + per < last) ? jobs[t].first + per : last;
+    jobs[t].problems = 0;
+    jobs[t].mount = mnt;
+    started[t] = (jobs[t].first < jobs[t].last &&
+                  pthread_create(&jobs[t].thread, NULL, worker, &jobs[t]) == 0);
+    if (!started[t] && jobs[t].first < jobs[t].last)
+    {
+      worker(&jobs[t]);
+    }
+  }
+
+  for (int t = 0; t < threads; t++)
+  {
+    if (started[t])
+    {
+      pthread_join(jobs[t].thread, NULL);
+    }
+    problems += jobs[t].problems;
+  }
+
+  return problems;
+}
+
+//check the block maps of a slice of inodes and record which inodes map
+//which blocks.  Each inode belongs to exactly one slice, so repairs to
+//its map need no locking; only the block claims are shared.
+void *fsck_inode_worker (void *arg)
+{
+  struct fsck_job *job = (struct fsck_job *) arg;
+
+  mnt = job->mount;
+
+  for (int i = job->first; i < job->last; i++)
+  {
+    struct inode *inode = mnt->inode_array_ptr[i];
+    int len = 0;
+    int flags = 0;
+
+    struct fsck_inode *found = &fsck_inodes[i];
+
+    memset(found, 0, sizeof(*found));
+
+    if (!fsck_in_use[i])
+    {
+      continue;
+    }
+
+    while (len < MAX_BLOCKS_PER_FILE && inode->blocks[len] >= 130 &&
+           inode->blocks[len] < NUM_BLOCKS)
+    {
+      len++;
+    }
+
+    if (len < MAX_BLOCKS_PER_FILE && inode->blocks[len] != -1)
+    {
+      flags |= FSCK_BAD_BLOCK;
+      found->bad_block = inode->blocks[len];
+    }
+
+    for (int j = len + 1; j < MAX_BLOCKS_PER_FILE; j++)
+    {
+      if (inode->blocks[j] != -1)
+      {
+        flags |= FSCK_MAP_HOLE;
+        break;
+      }
+    }
+
+    int needed = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if (inode->size < 0 || needed != len)
+    {
+      flags |= FSCK_BAD_SIZE;
+    }
+
+    //a packed file's slice has to lie inside its pack block
+    if (inode->packed && (inode->pack_offset < 0 || inode->pack_offset % PACK_ALIGN != 0 ||
+                          inode->pack_offset + inode->size > BLOCK_SIZE))
+    {
+      flags |= FSCK_BAD_PACK;
+      found->pack_offset = inode->pack_offset;
+    }
+
+    found->size = inode->size;
+    found->mapped = inode_block_count(i);
+
+    if (fsck_repair && flags != 0)
+    {
+      //keep the good front of the map and make the size agree with it,
+      //blocks cut off here are freed by the block pass
+      if (inode->size < 0)
+      {
+        inode->size = 0;
+      }
+
+      if (inode->packed && (flags & FSCK_BAD_PACK))
+      {
+        if (inode->pack_offset < 0 || inode->pack_offset % PACK_ALIGN != 0 ||
+            inode->pack_offset >= BLOCK_SIZE)
+        {
+          inode->pack_offset = 0;
+        }
+        if (inode->pack_offset + inode->size > BLOCK_SIZE)
+        {
+          inode->size = BLOCK_SIZE - inode->pack_offset;
+        }
+      }
+
+      needed = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+      if (needed > len)
+      {
+        inode->size = len * BLOCK_SIZE;
+      }
+      else
+      {
+        len = needed;
+      }
+
+      for (int j = len; j < MAX_BLOCKS_PER_FILE; j++)
+      {
+        inode->blocks[j] = -1;
+      }
+    }
+
+    for (int j = 0; j < len; j++)
+    {
+      __atomic_fetch_add(&fsck_claims[inode->blocks[j]], 1, __ATOMIC_RELAXED);
+    }
+
+    found->map_len = len;
+    found->flags = flags;
+    if (flags != 0)
+    {
+      job->problems++;
+    }
+  }
+
+  return NULL;
+}
+
+//compare a slice of used_blocks with the block claims of the inodes
+void *fsck_block_worker (void *arg)
+{
+  struct fsck_job *job = (struct fsck_job *) arg;
+
+  mnt = job->mount;
+
+  for (int b = job->first; b < job->last; b++)
+  {
+    int refs = (b < 130) ? 1 : fsck_claims[b];
+
+    fsck_block_status[b] = FSCK_BLOCK_OK;
+
+    if (mnt->used_blocks[b] == refs)
+    {
+      continue;
+    }
+
+    if (refs == 0)
+    {
+      fsck_block_status[b] = FSCK_BLOCK_LEAKED;
+    }
+    else if (mnt->used_blocks[b] == 0)
+    {
+      fsck_block_status[b] = FSCK_BLOCK_UNMARKED;
+    }
+    else
+    {
+      fsck_block_status[b] = FSCK_BLOCK_MISCOUNTED;
+    }
+
+    job->problems++;
+    if (fsck_repair)
+    {
+      mnt->used_blocks[b] = refs;
+    }
+  }
+
+  return NULL;
+}
+
+//check that the free extent lists describe exactly the free blocks of
+//used_blocks, each run whole and in the right size class
+int fsck_extents_ok()
+{
+  int free_count = 0;
+  int listed = 0;
+
+  for (int b = 130; b < NUM_BLOCKS; b++)
+  {
+    if (mnt->used_blocks[b] == 0) free_count++;
+  }
+
+  for (int c = 0; c < EXTENT_CLASSES; c++)
+  {
+    int steps = 0;
+
+    for (int s = mnt->extent_head[c]; s != -1; s = mnt->extent_next[s])
+    {
+      if (s < 130 || s >= NUM_BLOCKS || ++steps > NUM_BLOCKS)
+      {
+        return 0;
+      }
+
+      int len = mnt->extent_len[s];
+
+      if (len < 1 || s + len > NUM_BLOCKS || extent_class(len) != c ||
+          mnt->extent_first[s + len - 1] != s)
+      {
+        return 0;
+      }
+
+      //a run has to be free throughout and bounded by used blocks
+      for (int b = s; b < s + len; b++)
+      {
+        if (mnt->used_blocks[b] != 0) return 0;
+      }
+
+      if ((s > 130 && mnt->used_blocks[s - 1] == 0) ||
+          (s + len < NUM_BLOCKS && mnt->used_blocks[s + len] == 0))
+      {
+        return 0;
+      }
+
+      listed += len;
+    }
+  }
+
+  return listed == free_count && mnt->free_blocks == free_count;
+}
+
+//the tombstone list has to reach every tombstone exactly once, with
+//prev links that match.  Returns 1 if it does.
+int fsck_tombstones_ok (int *order, int *count)
+{
+  int seen[NUM_INODES] = {0};
+  int prev = -1;
+  int ok = 1;
+
+  *count = 0;
+
+  for (int i = mnt->tombstone_head; i != -1; i = mnt->tombstones[i].next)
+  {
+    if (i < 0 || i >= NUM_INODES || seen[i] || mnt->tombstones[i].name == NULL ||
+        mnt->tombstones[i].prev != prev)
+    {
+      ok = 0;
+      break;
+    }
+
+    seen[i] = 1;
+    order[(*count)++] = i;
+    prev = i;
+  }
+
+  if (ok && mnt->tombstone_tail != prev)
+  {
+    ok = 0;
+  }
+
+  //tombstones the list does not reach go at the end, oldest inode first
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    if (mnt->tombstones[i].name != NULL && !seen[i])
+    {
+      ok = 0;
+      order[(*count)++] = i;
+    }
+  }
+
+  return ok;
+}
+
+//reattach an inode no directory entry refers to under a made up name.
+//Returns the directory entry or -1 if the directory is full.
+int fsck_reconnect (int inode_idx)
+{
+  int dir_idx = findFreeDirectoryEntry();
+
+  if (dir_idx == -1)
+  {
+    return -1;
+  }
+
+  char name[MAX_FILE_NAME + 1];
+  snprintf(name, sizeof(name), "lost+found.%d", inode_idx);
+
+  mnt->directory_ptr[dir_idx].name = name_dup(name);
+  mnt->directory_ptr[dir_idx].inode_idx = inode_idx;
+  mnt->directory_ptr[dir_idx].hidden = 0;
+  mnt->directory_ptr[dir_idx].read_only = 0;
+  mnt->directory_ptr[dir_idx].valid = 1;
+
+  return dir_idx;
+}
+
+//cross-check the directory, the inodes, the tombstones and the block
+//bitmap, and with repair set fix what is wrong.  Only metadata is
+//looked at, so data blocks that are not cached are never read.  The
+//inode and block passes are split across threads.  Returns the number
+//of problems found.
+int fsck (int repair)
+{
+  int problems = 0;
+  int repaired = 0;
+  int refs[NUM_INODES] = {0};
+  int order[NUM_INODES];
+  int count;
+
+  fsck_repair = repair;
+
+  int live = 0;
+  for (int d = 0; d < NUM_FILES; d++)
+  {
+    if (mnt->directory_ptr[d].valid == 1) live++;
+  }
+
+  //the list index is rebuilt below whenever anything is repaired
+  if (live != mnt->list_index_count)
+  {
+    printf("fsck: The list index holds %d files, not %d\n", mnt->list_index_count, live);
+    problems++;
+    repaired += repair;
+  }
+
+  //tombstones first, whether an inode is in use depends on them
+  if (!fsck_tombstones_ok(order, &count))
+  {
+    printf("fsck: The list of deleted files is damaged\n");
+    problems++;
+
+    if (repair)
+    {
+      mnt->tombstone_head = -1;
+      mnt->tombstone_tail = -1;
+      for (int n = 0; n < count; n++)
+      {
+        int i = order[n];
+
+        mnt->tombstones[i].next = -1;
+        mnt->tombstones[i].prev = mnt->tombstone_tail;
+        if (mnt->tombstone_tail != -1) mnt->tombstones[mnt->tombstone_tail].next = i;
+        else mnt->tombstone_head = i;
+        mnt->tombstone_tail = i;
+      }
+      repaired++;
+    }
+  }
+
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    if (mnt->tombstones[i].name != NULL && mnt->inode_array_ptr[i]->valid == 1)
+    {
+      printf("fsck: Inode %d is live but also on the deleted list as %s\n",
+             i, mnt->tombstones[i].name);
+      problems++;
+
+      if (repair)
+      {
+        name_free(mnt->tombstones[i].name);
+        tombstone_unlink(i);
+        repaired++;
+      }
+    }
+  }
+
+  //every live entry needs a name and a live inode of its own
+  for (int d = 0; d < NUM_FILES; d++)
+  {
+    struct directory_entry *entry = &mnt->directory_ptr[d];
+    int inode_idx = entry->inode_idx;
+    int drop = 0;
+
+    if (entry->valid != 1)
+    {
+      continue;
+    }
+
+    if (inode_idx < 0 || inode_idx >= NUM_INODES || mnt->inode_array_ptr[inode_idx]->valid != 1)
+    {
+      printf("fsck: Entry %d (%s) refers to inode %d which is not in use\n",
+             d, entry->name ? entry->name : "no name", inode_idx);
+      drop = 1;
+    }
+    else if (refs[inode_idx] > 0)
+    {
+      printf("fsck: Entry %d (%s) shares inode %d with another entry\n",
+             d, entry->name ? entry->name : "no name", inode_idx);
+      drop = 1;
+    }
+    else if (entry->name == NULL)
+    {
+      printf("fsck: Entry %d for inode %d has no name\n", d, inode_idx);
+      if (repair)
+      {
+        char name[MAX_FILE_NAME + 1];
+        snprintf(name, sizeof(name), "lost+found.%d", inode_idx);
+        entry->name = name_dup(name);
+        repaired++;
+      }
+      problems++;
+    }
+    else
+    {
+      for (int e = 0; e < d; e++)
+      {
+        if (mnt->directory_ptr[e].valid == 1 && mnt->directory_ptr[e].name != NULL &&
+            !strcmp(mnt->directory_ptr[e].name, entry->name))
+        {
+          printf("fsck: Entries %d and %d are both named %s\n", e, d, entry->name);
+          problems++;
+          if (repair)
+          {
+            char name[MAX_FILE_NAME + 1];
+            snprintf(name, sizeof(name), "lost+found.%d", inode_idx);
+            name_free(entry->name);
+            entry->name = name_dup(name);
+            repaired++;
+          }
+          break;
+        }
+      }
+    }
+
+    if (drop)
+    {
+      problems++;
+      if (repair)
+      {
+        name_free(entry->name);
+        entry->name = NULL;
+        entry->valid = 0;
+        repaired++;
+      }
+      continue;
+    }
+
+    refs[inode_idx]++;
+  }
+
+  //live inodes no entry refers to
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    if (mnt->inode_array_ptr[i]->valid != 1 || refs[i] > 0 || mnt->tombstones[i].name != NULL)
+    {
+      continue;
+    }
+
+    printf("fsck: Inode %d is in use but no file refers to it", i);
+    problems++;
+
+    if (repair)
+    {
+      int dir_idx = fsck_reconnect(i);
+
+      if (dir_idx != -1)
+      {
+        printf(", reconnected as %s", mnt->directory_ptr[dir_idx].name);
+      }
+      else
+      {
+        //no room in the directory, the block pass frees its blocks
+        mnt->inode_array_ptr[i]->valid = 0;
+        for (int j = 0; j < MAX_BLOCKS_PER_FILE; j++)
+        {
+          mnt->inode_array_ptr[i]->blocks[j] = -1;
+        }
+        printf(", cleared");
+      }
+      mark_inode_dirty(i);
+      repaired++;
+    }
+    printf("\n");
+  }
+
+  //block maps, in parallel
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    fsck_in_use[i] = (mnt->inode_array_ptr[i]->valid == 1 || mnt->tombstones[i].name != NULL);
+  }
+
+  memset(fsck_claims, 0, sizeof(fsck_claims));
+
+  int bad_inodes = fsck_parallel(fsck_inode_worker, 0, NUM_INODES);
+
+  problems += bad_inodes;
+
+  for (int i = 0; i < NUM_INODES && bad_inodes > 0; i++)
+  {
+    struct fsck_inode *found = &fsck_inodes[i];
+    int flags = found->flags;
+
+    if (flags & FSCK_BAD_BLOCK)
+    {
+      printf("fsck: Inode %d maps block %d outside the data area\n", i, found->bad_block);
+    }
+    if (flags & FSCK_MAP_HOLE)
+    {
+      printf("fsck: Inode %d maps blocks past the end of its block list\n", i);
+    }
+    if (flags & FSCK_BAD_SIZE)
+    {
+      printf("fsck: Inode %d has size %d but maps %d blocks\n", i, found->size, found->mapped);
+    }
+    if (flags & FSCK_BAD_PACK)
+    {
+      printf("fsck: Inode %d has a packed slice at %d running past its block\n", i, found->pack_offset);
+    }
+    if (repair && flags != 0)
+    {
+      mark_inode_dirty(i);
+      repaired++;
+    }
+  }
+
+  //the block bitmap against the block maps, in parallel
+  int bad_blocks = fsck_parallel(fsck_block_worker, 0, NUM_BLOCKS);
+
+  problems += bad_blocks;
+
+  for (int b = 0; b < NUM_BLOCKS && bad_blocks > 0; b++)
+  {
+    int status = fsck_block_status[b];
+    int end = b;
+
+    if (status == FSCK_BLOCK_OK)
+    {
+      continue;
+    }
+
+    while (end + 1 < NUM_BLOCKS && fsck_block_status[end + 1] == status)
+    {
+      end++;
+    }
+
+    char *problem = "have the wrong reference count";
+
+    if (status == FSCK_BLOCK_LEAKED)
+    {
+      problem = "are marked in use but no file maps them";
+    }
+    else if (status == FSCK_BLOCK_UNMARKED)
+    {
+      problem = "are in use but marked free";
+    }
+
+    printf("fsck: Blocks %d-%d %s\n", b, end, problem);
+    b = end;
+  }
+
+  if (repair && bad_blocks > 0)
+  {
+    repaired += bad_blocks;
+  }
+
+  if (!fsck_extents_ok())
+  {
+    if (bad_blocks == 0)
+    {
+      printf("fsck: The free extent lists do not match the block bitmap\n");
+      problems++;
+      repaired += repair;
+    }
+
+    if (repair)
+    {
+      extent_rebuild();
+    }
+  }
+
+  int reclaimable = 0;
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    if (mnt->tombstones[i].name != NULL)
+    {
+      reclaimable += inode_block_count(i);
+    }
+  }
+
+  if (reclaimable != mnt->reclaimable_blocks)
+  {
+    printf("fsck: Deleted files hold %d blocks, not %d\n", reclaimable, mnt->reclaimable_blocks);
+    problems++;
+    if (repair)
+    {
+      mnt->reclaimable_blocks = reclaimable;
+      repaired++;
+    }
+  }
+
+  if (repair && problems > 0)
+  {
+    mnt->list_index_count = 0;
+    for (int d = 0; d < NUM_FILES; d++)
+    {
+      if (mnt->directory_ptr[d].valid == 1)
+      {
+        list_index_insert(d);
+      }
+    }
+    mark_dirty(0);
+  }
+
+  if (problems == 0)
+  {
+    printf("fsck: No problems found\n");
+  }
+  else if (repair)
+  {
+    printf("fsck: %d problems found, %d repaired\n", problems, repaired);
+  }
+  else
+  {
+    printf("fsck: %d problems found, run fsck -y to repair them\n", problems);
+  }
+
+  return problems;
+}
+
+//enter a file just put into the directory.  Inside a transaction the
+//file stays staged until commit.
+void file_publish (int dir_idx, int inode_idx, char *name, int size)
+{
+  int valid = mnt->txn_active ? ENTRY_STAGED : 1;
+
+  mnt->directory_ptr[dir_idx].valid = valid; //used
+
+  mnt->directory_ptr[dir_idx].name = name_dup(name); //Copy file name
+
+  mnt->directory_ptr[dir_idx].inode_idx = inode_idx;
+
+  mnt->inode_array_ptr[inode_idx]->valid = valid;
+  mnt->inode_array_ptr[inode_idx]->size = size;
+  mnt->inode_array_ptr[inode_idx]->date = time(NULL); 
+
+  mark_dirty(0);
+  mark_inode_dirty(inode_idx);
+
+  if (valid == 1)
+  {
+    list_index_insert(dir_idx);
+  }
+
+  stats_bytes(size);
+}
+
+//find room for a slice of size bytes in the current pack block, starting
+//a new one when it is full.  Returns the pack block, loaded and with the
+//slice counted in its references, and sets *offset, or -1 when full.
+int pack_alloc (int size, int *offset)
+{
+  if (mnt->pack_block != -1 && mnt->pack_used + size <= BLOCK_SIZE)
+  {
+    block_load(mnt->pack_block);
+    mnt->used_blocks[mnt->pack_block]++;
+  }
+  else
+  {
+    int block = alloc_block_after(-1);
+
+    if (block == -1)
+    {
+      return -1;
+    }
+
+    memset(mnt->data_blocks[block], 0, BLOCK_SIZE);
+    mnt->pack_blocks[block] = 1;
+    mnt->pack_block = block;
+    mnt->pack_used = 0;
+  }
+
+  *offset = mnt->pack_used;
+  mnt->pack_used += (size + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+
+  return mnt->pack_block;
+}
+
+//read a small file of size bytes from ifp into a slice of a pack block.
+//Returns 0 or -1.
+int file_pack (int inode_idx, FILE *ifp, int size)
+{
+  struct inode *inode = mnt->inode_array_ptr[inode_idx];
+  int offset;
+  int block = pack_alloc(size, &offset);
+
+  if (block == -1)
+  {
+    return -1;
+  }
+
+  if (fread(mnt->data_blocks[block] + offset, size, 1, ifp) != 1)
+  {
+    release_block(block);
+    return -1;
+  }
+
+  mark_dirty(block);
+
+  inode->blocks[0] = block;
+  inode->packed = 1;
+  inode->pack_offset = offset;
+
+  return 0;
+}
+
+//give a packed file a block of its own before it is written to.
+//Returns 0 or -1 when there is no block to move it to.
+int file_unpack (int inode_idx)
+{
+  struct inode *inode = mnt->inode_array_ptr[inode_idx];
+
+  if (!inode->packed)
+  {
+    return 0;
+  }
+
+  int pack = inode->blocks[0];
+  int block = alloc_block_after(-1);
+
+  if (block == -1)
+  {
+    return -1;
+  }
+
+  block_load(pack);
+  memcpy(mnt->data_blocks[block], mnt->data_blocks[pack] + inode->pack_offset, inode->size);
+  memset(mnt->data_blocks[block] + inode->size, 0, BLOCK_SIZE - inode->size);
+  mark_dirty(block);
+
+  inode->blocks[0] = block;
+  inode->packed = 0;
+  inode->pack_offset = 0;
+  mark_inode_dirty(inode_idx);
+
+  release_block(pack);
+
+  return 0;
+}
+
+//the bytes of the file's block at entry, which for a packed file start
+//part way into the shared block
+unsigned char *file_data (int inode_idx, int entry)
+{
+  struct inode *inode = mnt->inode_array_ptr[inode_idx];
+
+  return mnt->data_blocks[inode->blocks[entry]] + (inode->packed ? inode->pack_offset : 0);
+}
+
+//move the slices out of pack blocks that have become mostly empty into
+//the current pack block, so the sparse ones are freed.  Files sharing a
+//slice through cp move together and keep sharing it.
+void pack_compact()
+{
+  static int live[NUM_BLOCKS];
+
+  memset(live, 0, sizeof(live));
+
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    if (inode_in_use(i) && mnt->inode_array_ptr[i]->packed)
+    {
+      live[mnt->inode_array_ptr[i]->blocks[0]] += mnt->inode_array_ptr[i]->size;
+    }
+  }
+
+  for (int b = 130; b < NUM_BLOCKS; b++)
+  {
+    if (!mnt->pack_blocks[b] || b == mnt->pack_block || live[b] * PACK_SPARSE >= BLOCK_SIZE)
+    {
+      continue;
+    }
+
+    for (int i = 0; i < NUM_INODES; i++)
+    {
+      struct inode *inode = mnt->inode_array_ptr[i];
+
+      if (!inode_in_use(i) || !inode->packed || inode->blocks[0] != b)
+      {
+        continue;
+      }
+
+      int old_offset = inode->pack_offset;
+      int offset;
+      int block = pack_alloc(inode->size, &offset);
+
+      if (block == -1)
+      {
+        return;
+      }
+
+      block_load(b);
+      memcpy(mnt->data_blocks[block] + offset, mnt->data_blocks[b] + old_offset, inode->size);
+      mark_dirty(block);
+
+      for (int j = i; j < NUM_INODES; j++)
+      {
+        struct inode *other = mnt->inode_array_ptr[j];
+
+        if (!inode_in_use(j) || !other->packed || other->blocks[0] != b ||
+            other->pack_offset != old_offset)
+        {
+          continue;
+        }
+
+        if (j != i)
+        {
+          mnt->used_blocks[block]++;
+        }
+
+        other->blocks[0] = block;
+        other->pack_offset = offset;
+        mark_inode_dirty(j);
+        release_block(b);
+      }
+    }
+  }
+}
+
+//copy a stream of unknown length, such as stdin or a pipe, into the
+//file system as name.  Blocks are claimed one at a time as the data
+//arrives and the size is only known at end of file.  Returns 0 or -1.
+int put_stream (FILE *ifp, char *name)
+{
+  //check the length of the file name.
+  if (strlen(name) > MAX_FILE_NAME)
+  {
+    printf("put error: File name too long\n");
+    return -1;
+  }
+
+  int dir_idx = findFreeDirectoryEntry();
+
+  if (dir_idx == -1)
+  {
+    printf("Error: Not enough disk space\n");
+    return -1;
+  }
+
+  int inode_idx = findFreeInode();
+
+  if (inode_idx == -1)
+  {
+    printf("Error: No free inodes\n");
+    return -1;
+  }
+
+  int *blocks = mnt->inode_array_ptr[inode_idx]->blocks;
+  int size = 0;
+  int count = 0;
+  int error = 0;
+
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+  {
+    blocks[i] = -1;
+  }
+
+  while (!feof(ifp))
+  {
+    int block_index = alloc_block_after((count > 0) ? blocks[count - 1] : -1);
+
+    if (block_index == -1)
+    {
+      printf("Error: No free blocks\n");
+      error = 1;
+      break;
+    }
+
+    TRACE_START(trace_start);
+
+    // fread keeps reading short pipe reads until the block is full
+    int bytes = fread(mnt->data_blocks[block_index], 1, BLOCK_SIZE, ifp);
+
+    TRACE_END("put_stream_read", trace_start, "block", block_index, "bytes", bytes);
+
+    if (ferror(ifp))
+    {
+      printf("An error occured reading from the input file.\n");
+      release_block(block_index);
+      error = 1;
+      break;
+    }
+
+    if (bytes == 0)
+    {
+      release_block(block_index);
+      break;
+    }
+
+    blocks[count++] = block_index;
+    size += bytes;
+    mark_dirty(block_index);
+
+    //a full inode is only an error if there is more data to come
+    if (count == MAX_BLOCKS_PER_FILE)
+    {
+      int c = fgetc(ifp);
+      if (c != EOF)
+      {
+        printf("put error: File too large\n");
+        error = 1;
+      }
+      break;
+    }
+  }
+
+  if (error)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      release_block(blocks[i]);
+      blocks[i] = -1;
+    }
+    return -1;
+  }
+
+  printf("Read %d bytes into %s\n", size, name );
+
+  file_publish(dir_idx, inode_idx, name, size);
+
+  return 0;
+}
+
+//copy a host file into the file system under the same name.
+//The blocks for the whole file are claimed up front, so each run
+//of them is filled with a single read.  Returns 0 or -1 on error.
+int put_file (char *filename)
+{
+  int status;                   // Hold the status of all return values.
+  struct stat buf;              // stat struct to hold the returns from the stat call
+
+  status = stat( filename, &buf ); 
+
+  //Verify that the file exists
+  if (status == -1)
+  {
+    printf("Unable to open file: %s\n", filename );
+    perror("Opening the input file returned");
+    return -1;
+  }
+
+  //check the length of the file name.
+  if (strlen(filename) > MAX_FILE_NAME)
+  {
+    printf("put error: File name too long\n");
+    return -1;
+  }
+
+  //pipes and devices have no size up front, stream them in instead
+  if (!S_ISREG(buf.st_mode))
+  {
+    FILE *ifp = fopen ( filename, "r" );
+
+    if (ifp == NULL)
+    {
+      printf("Unable to open file: %s\n", filename );
+      perror("Opening the input file returned");
+      return -1;
+    }
+
+    status = put_stream(ifp, filename);
+    fclose( ifp );
+    return status;
+  }
+
+  //Check if there is enough space, counting what deleted files hold
+  if (buf.st_size > df() + df_reclaimable())
+  {
+    printf("put error: Not enough disk space\n");
+    return -1;
+  }
+
+  int block_count = (buf.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  if (block_count > MAX_BLOCKS_PER_FILE)
+  {
+    printf("put error: File too large\n");
+    return -1;
+  }
+
+  reclaim_blocks(block_count);
+
+  int dir_idx = findFreeDirectoryEntry();
+
+  if (dir_idx == -1)
+  {
+    printf("Error: Not enough disk space\n");
+    return -1;
+  }
+
+  int inode_idx = findFreeInode();
+
+  if (inode_idx == -1)
+  {
+    printf("Error: No free inodes\n");
+    return -1;
+  }
+
+  // Open the input file read-only 
+  FILE *ifp = fopen ( filename, "r" ); 
+
+  if (ifp == NULL)
+  {
+    printf("Unable to open file: %s\n", filename );
+    perror("Opening the input file returned");
+    return -1;
+  }
+
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+  {
+    mnt->inode_array_ptr[inode_idx]->blocks[i] = -1;
+  }
+
+  //small files share a pack block instead of each taking a whole one
+  if (buf.st_size > 0 && buf.st_size <= PACK_MAX_FILE)
+  {
+    printf("Reading %d bytes from %s\n", (int) buf . st_size, filename );
+
+    status = file_pack(inode_idx, ifp, buf.st_size);
+    fclose( ifp );
+
+    if (status == -1)
+    {
+      printf("Error: No free blocks\n");
+      return -1;
+    }
+
+    file_publish(dir_idx, inode_idx, filename, buf.st_size);
+
+    return 0;
+  }
+
+  if (alloc_file_blocks(inode_idx, block_count) == -1)
+  {
+    printf("Error: No free blocks\n");
+    fclose( ifp );
+    return -1;
+  }
+
+  printf("Reading %d bytes from %s\n", (int) buf . st_size, filename );
+
+  int *blocks = mnt->inode_array_ptr[inode_idx]->blocks;
+  int copy_size = buf.st_size;
+  int i = 0;
+
+  // In direct mode each run is read with one aligned pread straight into
+  // its blocks, the rounded up tail lands in the file's own last block.
+  int direct_fd = direct_io ? open_direct(filename, O_RDONLY) : -1;
+
+  // Read one run of consecutive blocks at a time.  data_blocks is laid out
+  // contiguously so a run of blocks is also one contiguous buffer.
+  while( copy_size > 0 )
+  {
+    int run = 1;
+    while (i + run < block_count && blocks[i + run] == blocks[i] + run)
+    {
+      run++;
+    }
+
+    int num_bytes = run * BLOCK_SIZE;
+
+    // The last run may end part way into its final block.
+    if( copy_size < num_bytes )
+    {
+      num_bytes = copy_size;
+    }
+
+    TRACE_START(trace_start);
+
+    int status;
+
+    if (direct_fd != -1)
+    {
+      status = pread_direct(direct_fd, mnt->data_blocks[blocks[i]], num_bytes,
+                            (off_t) buf.st_size - copy_size);
+    }
+    else
+    {
+      status = (fread( mnt->data_blocks[blocks[i]], num_bytes, 1, ifp ) == 1) ? 0 : -1;
+    }
+
+    if( status == -1 )
+    {
+      printf("An error occured reading from the input file.\n");
+      for (int j = 0; j < block_count; j++)
+      {
+        release_block(blocks[j]);
+        blocks[j] = -1;
+      }
+      if (direct_fd != -1) close(direct_fd);
+      fclose( ifp );
+      return -1;
+    }
+
+    TRACE_END("put_read", trace_start, "block", blocks[i], "bytes", num_bytes);
+
+    for (int j = i; j < i + run; j++)
+    {
+      mark_dirty(blocks[j]);
+    }
+
+    copy_size -= num_bytes;
+    i += run;
+  }
+
+  if (direct_fd != -1)
+  {
+    close(direct_fd);
+  }
+
+  fclose( ifp );
+
+  file_publish(dir_idx, inode_idx, filename, buf.st_size);
+
+  return 0;
+}
+
+//64 bit digest of len bytes, taken eight bytes at a time
+uint64_t block_digest (const unsigned char *data, int len)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t) len;
+  int i = 0;
+
+  for (; i + 8 <= len; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    h = (h ^ word) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+
+  for (; i < len; i++)
+  {
+    h = (h ^ data[i]) * 0x100000001b3ULL;
+  }
+
+  return h ^ (h >> 29);
+}
+
+//digest of the first len bytes of a data block.  Whole blocks are
+//remembered until they are written again.
+uint64_t block_hash (int block, int len)
+{
+  if (len == BLOCK_SIZE && mnt->block_hashed[block])
+  {
+    return mnt->block_hash[block];
+  }
+
+  block_load(block);
+  uint64_t h = block_digest(mnt->data_blocks[block], len);
+
+  if (len == BLOCK_SIZE)
+  {
+    mnt->block_hash[block] = h;
+    mnt->block_hashed[block] = 1;
+  }
+
+  return h;
+}
+
+//bring the stored copy of a host file up to date, writing only the
+//blocks whose contents changed.  A host block that matches one of the
+//file's blocks, at the same or another entry, goes on using that block,
+//so inserting or removing whole blocks costs no writes either.  Digests
+//pick the candidate blocks and every match is compared byte for byte,
+//so the stored file is read once but only changed blocks are written.
+//A file that is not stored yet is put.  Returns 0 or -1 on error.
+int sync_file (char *filename)
+{
+  static unsigned char chunk[BLOCK_SIZE];
+  struct stat buf;
+
+  if (stat(filename, &buf) == -1)
+  {
+    printf("Unable to open file: %s\n", filename );
+    perror("Opening the input file returned");
+    return -1;
+  }
+
+  int dir_idx = find_file_dir_idx(filename);
+
+  if (dir_idx == -1)
+  {
+    return put_file(filename);
+  }
+
+  if (!S_ISREG(buf.st_mode))
+  {
+    printf("sync: %s is not a regular file\n", filename);
+    return -1;
+  }
+
+  if (mnt->directory_ptr[dir_idx].read_only)
+  {
+    printf("sync: %s is read only\n", filename);
+    return -1;
+  }
+
+  int block_count = (buf.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  if (block_count > MAX_BLOCKS_PER_FILE)
+  {
+    printf("sync: File too large\n");
+    return -1;
+  }
+
+  int inode_idx = mnt->directory_ptr[dir_idx].inode_idx;
+
+  //blocks are compared and reused whole, so a packed file leaves its pack first
+  if (file_unpack(inode_idx) == -1)
+  {
+    printf("sync: Not enough disk space\n");
+    return -1;
+  }
+
+  int fd = open(filename, O_RDONLY);
+
+  if (fd == -1)
+  {
+    printf("Unable to open file: %s\n", filename );
+    perror("Opening the input file returned");
+    return -1;
+  }
+
+  struct inode *inode = mnt->inode_array_ptr[inode_idx];
+  int old_count = inode_block_count(inode_idx);
+  uint64_t old_hash[MAX_BLOCKS_PER_FILE];
+  int old_len[MAX_BLOCKS_PER_FILE];
+
+  for (int j = 0; j < old_count; j++)
+  {
+    old_len[j] = inode->size - j * BLOCK_SIZE;
+    if (old_len[j] > BLOCK_SIZE) old_len[j] = BLOCK_SIZE;
+    if (old_len[j] < 0) old_len[j] = 0;
+
+    old_hash[j] = block_hash(inode->blocks[j], old_len[j]);
+  }
+
+  //first pass, find the host blocks that are already stored somewhere
+  //in the file
+  int reuse[MAX_BLOCKS_PER_FILE];
+  int needed = 0;
+
+  for (int i = 0; i < block_count; i++)
+  {
+    int len = (buf.st_size - (off_t) i * BLOCK_SIZE > BLOCK_SIZE) ? BLOCK_SIZE
+              : (int) (buf.st_size - (off_t) i * BLOCK_SIZE);
+
+    if (pread_full(fd, chunk, len, (off_t) i * BLOCK_SIZE) == -1)
+    {
+      perror("sync: Reading the input file returned");
+      close(fd);
+      return -1;
+    }
+
+    uint64_t h = block_digest(chunk, len);
+
+    //the same entry is the likely match, then any other
+    reuse[i] = -1;
+    for (int n = -1; n < old_count && reuse[i] == -1; n++)
+    {
+      int j = (n == -1) ? i : n;
+
+      if (j >= old_count || (n != -1 && j == i) || old_len[j] != len || old_hash[j] != h)
+      {
+        continue;
+      }
+
+      int block = inode->blocks[j];
+
+      //equal digests only make a match likely, the bytes decide
+      block_load(block);
+      if (memcmp(mnt->data_blocks[block], chunk, len) != 0)
+      {
+        continue;
+      }
+
+      reuse[i] = block;
+    }
+
+    if (reuse[i] == -1)
+    {
+      needed++;
+    }
+  }
+
+  if (needed > mnt->free_blocks + mnt->reclaimable_blocks)
+  {
+    printf("sync: Not enough disk space\n");
+    close(fd);
+    return -1;
+  }
+
+  reclaim_blocks(needed);
+
+  //second pass, build the new block list and read in the changed blocks
+  int blocks[MAX_BLOCKS_PER_FILE];
+  int taken = 0;       // entries of blocks holding a reference
+  int failed = 0;
+
+  for (int i = 0; i < block_count; i++)
+  {
+    int len = (buf.st_size - (off_t) i * BLOCK_SIZE > BLOCK_SIZE) ? BLOCK_SIZE
+              : (int) (buf.st_size - (off_t) i * BLOCK_SIZE);
+
+    if (reuse[i] != -1)
+    {
+      blocks[i] = reuse[i];
+      mnt->used_blocks[blocks[i]]++;
+      taken = i + 1;
+      continue;
+    }
+
+    blocks[i] = alloc_block_after((i > 0) ? blocks[i - 1] : -1);
+
+    if (blocks[i] == -1)
+    {
+      printf("sync: No free blocks\n");
+      failed = 1;
+      break;
+    }
+    taken = i + 1;
+
+    TRACE_START(trace_start);
+
+    if (pread_full(fd, mnt->data_blocks[blocks[i]], len, (off_t) i * BLOCK_SIZE) == -1)
+    {
+      perror("sync: Reading the input file returned");
+      failed = 1;
+      break;
+    }
+
+    TRACE_END("sync_block", trace_start, "block", blocks[i], "bytes", len);
+
+    memset(mnt->data_blocks[blocks[i]] + len, 0, BLOCK_SIZE - len);
+    mark_dirty(blocks[i]);
+    stats_bytes(len);
+  }
+
+  close(fd);
+
+  //on failure drop what was taken, the file keeps its old blocks
+  if (failed)
+  {
+    for (int j = 0; j < taken; j++)
+    {
+      release_block(blocks[j]);
+    }
+    return -1;
+  }
+
+  for (int j = 0; j < old_count; j++)
+  {
+    release_block(inode->blocks[j]);
+  }
+
+  for (int j = 0; j < MAX_BLOCKS_PER_FILE; j++)
+  {
+    inode->blocks[j] = (j < block_count) ? blocks[j] : -1;
+  }
+
+  inode->size = buf.st_size;
+  inode->date = time(NULL);
+  mark_inode_dirty(inode_idx);
+
+  list_index_update(dir_idx);
+
+  printf("sync: %d of %d blocks of %s changed\n", needed, block_count, filename);
+
+  return 0;
+}
+
+//make name a copy of the file in directory entry src_idx.  The new
+//inode maps the same blocks and takes a reference on each, so no data
+//is copied until one of the two files is written.  Returns 0 or -1.
+int copy_file (int src_idx, char *name)
+{
+  if (strlen(name) > MAX_FILE_NAME)
+  {
+    printf("cp: File name too long\n");
+    return -1;
+  }
+
+  int dir_idx = findFreeDirectoryEntry();
+
+  if (dir_idx == -1)
+  {
+    printf("cp: No free directory entries\n");
+    return -1;
+  }
+
+  int inode_idx = findFreeInode();
+
+  if (inode_idx == -1)
+  {
+    printf("cp: No free inodes\n");
+    return -1;
+  }
+
+  struct inode *src = mnt->inode_array_ptr[mnt->directory_ptr[src_idx].inode_idx];
+  struct inode *dst = mnt->inode_array_ptr[inode_idx];
+
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+  {
+    dst->blocks[i] = src->blocks[i];
+    if (src->blocks[i] != -1)
+    {
+      mnt->used_blocks[src->blocks[i]]++;
+    }
+  }
+
+  dst->valid = 1;
+  dst->size = src->size;
+  dst->date = time(NULL);
+  dst->packed = src->packed;
+  dst->pack_offset = src->pack_offset;
+
+  mnt->directory_ptr[dir_idx].name = name_dup(name);
+  mnt->directory_ptr[dir_idx].inode_idx = inode_idx;
+  mnt->directory_ptr[dir_idx].hidden = 0;
+  mnt->directory_ptr[dir_idx].read_only = 0;
+  mnt->directory_ptr[dir_idx].valid = 1;
+
+  mark_dirty(0);
+  mark_inode_dirty(inode_idx);
+
+  list_index_insert(dir_idx);
+
+  return 0;
+}
+
+//rename the file in directory entry src_idx to name, replacing any
+//file already called that.  Only the directory changes, the file keeps
+//its entry, inode and blocks.  The replaced file is deleted the same
+//way del would, so undel can bring it back.  Commands run under fs_lock
+//and the flusher copies the directory block under it too, so the image
+//never holds a directory with neither file or with both under one name.
+void rename_file (int src_idx, char *name)
+{
+  int dst_idx = find_file_dir_idx(name);
+
+  if (dst_idx == src_idx)
+  {
+    return;
+  }
+
+  if (dst_idx != -1)
+  {
+    int inode_idx = mnt->directory_ptr[dst_idx].inode_idx;
+
+    list_index_remove(dst_idx);
+    tombstone_add(dst_idx);
+
+    mnt->directory_ptr[dst_idx].valid = 0;
+    mnt->directory_ptr[dst_idx].name = NULL;
+    mnt->inode_array_ptr[inode_idx]->valid = 0;
+    mark_inode_dirty(inode_idx);
+  }
+
+  name_free(mnt->directory_ptr[src_idx].name);
+  mnt->directory_ptr[src_idx].name = name_dup(name);
+
+  list_index_update(src_idx);
+  mark_dirty(0);
+}
+
+//grow or shrink a file to size bytes.  Blocks past the new end are
+//released, new blocks are claimed next to the current last block where
+//possible, and anything the file grows into reads back as zeros.
+//Returns 0 or -1 if the file would be too large or the space ran out.
+int file_resize (int inode_idx, int size)
+{
+  struct inode *inode = mnt->inode_array_ptr[inode_idx];
+  int old_count = inode_block_count(inode_idx);
+  int new_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  if (size < 0 || new_count > MAX_BLOCKS_PER_FILE || file_unpack(inode_idx) == -1)
+  {
+    return -1;
+  }
+
+  if (new_count > old_count && new_count - old_count > mnt->free_blocks + mnt->reclaimable_blocks)
+  {
+    return -1;
+  }
+
+  //the old last block may hold stale bytes past the old end
+  if (size > inode->size && inode->size % BLOCK_SIZE != 0)
+  {
+    int within = inode->size % BLOCK_SIZE;
+    int last = block_unshare(inode_idx, inode->size / BLOCK_SIZE, 0);
+
+    if (last == -1)
+    {
+      return -1;
+    }
+
+    block_load(last);
+    memset(mnt->data_blocks[last] + within, 0, BLOCK_SIZE - within);
+    mark_dirty(last);
+  }
+
+  for (int i = old_count; i < new_count; i++)
+  {
+    int block_index = alloc_block_after((i > 0) ? inode->blocks[i - 1] : -1);
+
+    if (block_index == -1)
+    {
+      for (int j = old_count; j < i; j++)
+      {
+        release_block(inode->blocks[j]);
+        inode->blocks[j] = -1;
+      }
+      return -1;
+    }
+
+    memset(mnt->data_blocks[block_index], 0, BLOCK_SIZE);
+    mark_dirty(block_index);
+    inode->blocks[i] = block_index;
+  }
+
+  for (int i = new_count; i < old_count; i++)
+  {
+    release_block(inode->blocks[i]);
+    inode->blocks[i] = -1;
+  }
+
+  inode->size = size;
+  mark_inode_dirty(inode_idx);
+
+  return 0;
+}
+
+//copy len bytes from ifp into the file at offset, growing the file if
+//the write ends past it.  The block holding any offset is found straight
+//from the inode's block list, so only the blocks being written are
+//touched.  Returns 0 or -1 on error.
+int file_write (int inode_idx, int offset, FILE *ifp, int len)
+{
+  struct inode *inode = mnt->inode_array_ptr[inode_idx];
+  int total = len;
+
+  //check the end before adding, offset + len may not fit in an int
+  if (offset < 0 || len < 0 || (long) offset > (long) MAX_BLOCKS_PER_FILE * BLOCK_SIZE - len ||
+      file_unpack(inode_idx) == -1)
+  {
+    return -1;
+  }
+
+  //room for copies of the shared blocks the write lands on, on top of
+  //any blocks the file grows by
+  int needed = count_shared_blocks(inode_idx, offset, offset + len);
+  int new_count = (offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  if (new_count > inode_block_count(inode_idx))
+  {
+    needed += new_count - inode_block_count(inode_idx);
+  }
+
+  if (needed > mnt->free_blocks + mnt->reclaimable_blocks)
+  {
+    return -1;
+  }
+
+  if (offset + len > inode->size && file_resize(inode_idx, offset + len) == -1)
+  {
+    return -1;
+  }
+
+  while (len > 0)
+  {
+    int within = offset % BLOCK_SIZE;
+    int num_bytes = BLOCK_SIZE - within;
+
+    if (len < num_bytes)
+    {
+      num_bytes = len;
+    }
+
+    int block_index = block_unshare(inode_idx, offset / BLOCK_SIZE, num_bytes == BLOCK_SIZE);
+
+    if (block_index == -1)
+    {
+      return -1;
+    }
+
+    //a partly overwritten block needs its old contents first
+    if (num_bytes < BLOCK_SIZE)
+    {
+      block_load(block_index);
+    }
+
+    TRACE_START(trace_start);
+
+    if (fread(mnt->data_blocks[block_index] + within, num_bytes, 1, ifp) != 1)
+    {
+      return -1;
+    }
+
+    TRACE_END("file_write", trace_start, "block", block_index, "bytes", num_bytes);
+
+    mark_dirty(block_index);
+    heat_touch(inode_idx, block_index);
+
+    offset += num_bytes;
+    len -= num_bytes;
+  }
+
+  stats_bytes(total);
+
+  return 0;
+}
+
+//copy up to len bytes starting at offset out of the file.
+//Returns the number of bytes copied, which is short at end of file.
+int file_read (int inode_idx, int offset, int len, unsigned char *out)
+{
+  struct inode *inode = mnt->inode_array_ptr[inode_idx];
+  int copied = 0;
+
+  if (offset < 0 || offset >= inode->size)
+  {
+    return 0;
+  }
+
+  if (len > inode->size - offset)
+  {
+    len = inode->size - offset;
+  }
+
+  while (copied < len)
+  {
+    int within = offset % BLOCK_SIZE;
+    int num_bytes = BLOCK_SIZE - within;
+
+    if (len - copied < num_bytes)
+    {
+      num_bytes = len - copied;
+    }
+
+    block_read_access(inode_idx, offset / BLOCK_SIZE);
+    memcpy(out + copied, file_data(inode_idx, offset / BLOCK_SIZE) + within, num_bytes);
+
+    offset += num_bytes;
+    copied += num_bytes;
+  }
+
+  stats_bytes(copied);
+
+  return copied;
+}
+
+//print bytes in hexadecimal, formatted into one buffer
+void print_hex (int offset, unsigned char *bytes, int len)
+{
+  int lines = (len + READ_BYTES_PER_LINE - 1) / READ_BYTES_PER_LINE;
+  char *out = malloc(lines * (12 + 3 * READ_BYTES_PER_LINE) + 1);
+  int n = 0;
+
+  for (int i = 0; i < len; i++)
+  {
+    if (i % READ_BYTES_PER_LINE == 0)
+    {
+      n += sprintf(out + n, "%s%08x:", (i > 0) ? "\n" : "", offset + i);
+    }
+    n += sprintf(out + n, " %02x", bytes[i]);
+  }
+
+  if (len > 0)
+  {
+    out[n++] = '\n';
+  }
+
+  fflush(stdout);
+  if (write(STDOUT_FILENO, out, n) != n)
+  {
+    perror("read: write");
+  }
+
+  free(out);
+}
+
+//write a whole host file into an existing file at offset,
+//shared by the write and append commands.  Returns 0 or -1.
+int write_host_file (int dir_idx, int offset, char *hostfile)
+{
+  struct stat buf;
+
+  if (stat(hostfile, &buf) == -1)
+  {
+    printf("Unable to open file: %s\n", hostfile );
+    perror("Opening the input file returned");
+    return -1;
+  }
+
+  if (buf.st_size > (off_t) MAX_BLOCKS_PER_FILE * BLOCK_SIZE)
+  {
+    printf("write error: File too large\n");
+    return -1;
+  }
+
+  FILE *ifp = fopen(hostfile, "r");
+
+  if (ifp == NULL)
+  {
+    printf("Unable to open file: %s\n", hostfile );
+    perror("Opening the input file returned");
+    return -1;
+  }
+
+  int inode_idx = mnt->directory_ptr[dir_idx].inode_idx;
+  int status = file_write(inode_idx, offset, ifp, buf.st_size);
+
+  fclose(ifp);
+
+  if (status == -1)
+  {
+    printf("write error: Not enough disk space or file too large\n");
+    return -1;
+  }
+
+  list_index_update(dir_idx);
+
+  return 0;
+}
+
+//buffered sequential I/O on an archive, so the archive is only ever
+//read or written ARCHIVE_BUFFER bytes at a time
+int archive_flush (struct archive *ar)
+{
+  unsigned char *p = ar->buf;
+
+  while (ar->len > 0)
+  {
+    ssize_t n = write(ar->fd, p, ar->len);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+
+    p += n;
+    ar->len -= n;
+  }
+
+  return 0;
+}
+
+int archive_write (struct archive *ar, void *data, size_t len)
+{
+  unsigned char *p = data;
+
+  ar->offset += len;
+
+  while (len > 0)
+  {
+    size_t chunk = ARCHIVE_BUFFER - ar->len;
+    if (chunk > len) chunk = len;
+
+    memcpy(ar->buf + ar->len, p, chunk);
+    ar->len += chunk;
+    p += chunk;
+    len -= chunk;
+
+    if (ar->len == ARCHIVE_BUFFER && archive_flush(ar) == -1)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+//write zeros up to the next multiple of unit bytes
+int archive_pad (struct archive *ar, size_t unit)
+{
+  return archive_write(ar, tar_zeros, (unit - ar->offset % unit) % unit);
+}
+
+//read len bytes, or skip them when data is NULL.  Returns the number
+//of bytes read, which is short only at the end of the archive.
+size_t archive_read (struct archive *ar, void *data, size_t len)
+{
+  unsigned char *p = data;
+  size_t done = 0;
+
+  while (done < len)
+  {
+    if (ar->pos == ar->len)
+    {
+      ssize_t n = read(ar->fd, ar->buf, ARCHIVE_BUFFER);
+
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+
+      ar->pos = 0;
+      ar->len = n;
+    }
+
+    size_t chunk = ar->len - ar->pos;
+    if (chunk > len - done) chunk = len - done;
+
+    if (p != NULL)
+    {
+      memcpy(p + done, ar->buf + ar->pos, chunk);
+    }
+    ar->pos += chunk;
+    done += chunk;
+  }
+
+  ar->offset += done;
+
+  return done;
+}
+
+//write value as a zero padded octal number filling a header field
+void tar_octal (char *field, int size, unsigned long value)
+{
+  char digits[24];
+
+  snprintf(digits, sizeof(digits), "%0*lo", size - 1, value);
+  memcpy(field, digits, size - 1);
+  field[size - 1] = '\0';
+}
+
+unsigned long tar_parse_octal (char *field, int size)
+{
+  unsigned long value = 0;
+  int i = 0;
+
+  while (i < size && field[i] == ' ')
+  {
+    i++;
+  }
+
+  for (; i < size && field[i] >= '0' && field[i] <= '7'; i++)
+  {
+    value = value * 8 + (field[i] - '0');
+  }
+
+  return value;
+}
+
+//the header checksum is the byte sum with the checksum field as spaces
+unsigned int tar_checksum (struct tar_header *hdr)
+{
+  unsigned char *p = (unsigned char *) hdr;
+  unsigned int sum = 0;
+
+  //the checksum field is bytes 148 to 155
+  for (int i = 0; i < TAR_BLOCK; i++)
+  {
+    sum += (i >= 148 && i < 156) ? ' ' : p[i];
+  }
+
+  return sum;
+}
+
+int tar_write_header (struct archive *ar, char *name, char type, unsigned long size,
+                      int mode, time_t mtime)
+{
+  struct tar_header hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  strncpy(hdr.name, name, sizeof(hdr.name) - 1);
+  tar_octal(hdr.mode, sizeof(hdr.mode), mode);
+  tar_octal(hdr.uid, sizeof(hdr.uid), 0);
+  tar_octal(hdr.gid, sizeof(hdr.gid), 0);
+  tar_octal(hdr.size, sizeof(hdr.size), size);
+  tar_octal(hdr.mtime, sizeof(hdr.mtime), (unsigned long) mtime);
+  hdr.typeflag = type;
+  memcpy(hdr.magic, "ustar", 6);
+  memcpy(hdr.version, "00", 2);
+
+  snprintf(hdr.chksum, sizeof(hdr.chksum), "%06o", tar_checksum(&hdr));
+  hdr.chksum[7] = ' ';
+
+  return archive_write(ar, &hdr, sizeof(hdr));
+}
+
+//write one file to the archive.  hidden has no ustar field, so it goes
+//in a pax extended header in front of the file, which other tar
+//programs skip.  Returns 0 or -1.
+int export_file (struct archive *ar, int dir_idx)
+{
+  int inode_idx = mnt->directory_ptr[dir_idx].inode_idx;
+  struct inode *inode = mnt->inode_array_ptr[inode_idx];
+  char *name = mnt->directory_ptr[dir_idx].name;
+
+  if (mnt->directory_ptr[dir_idx].hidden == 1)
+  {
+    //a pax record is "<length> key=value\n", the length counting itself
+    char record[32];
+    char pax_name[TAR_NAME_SIZE];
+    int len = strlen(" " PAX_HIDDEN "=1\n") + 2;
+
+    snprintf(record, sizeof(record), "%d " PAX_HIDDEN "=1\n", len);
+    snprintf(pax_name, sizeof(pax_name), "PaxHeaders/%s", name);
+
+    if (tar_write_header(ar, pax_name, 'x', len, 0644, inode->date) == -1 ||
+        archive_write(ar, record, len) == -1 ||
+        archive_pad(ar, TAR_BLOCK) == -1)
+    {
+      return -1;
+    }
+  }
+
+  if (tar_write_header(ar, name, '0', inode->size,
+                       mnt->directory_ptr[dir_idx].read_only ? 0444 : 0644, inode->date) == -1)
+  {
+    return -1;
+  }
+
+  //one write per run of consecutive blocks, readahead keeps the
+  //blocks of the next runs coming in from the image meanwhile
+  int count = inode_block_count(inode_idx);
+  int left = inode->size;
+
+  for (int i = 0; i < count && left > 0; )
+  {
+    int run = 1;
+
+    block_read_access(inode_idx, i);
+    while (i + run < count && inode->blocks[i + run] == inode->blocks[i] + run)
+    {
+      block_read_access(inode_idx, i + run);
+      run++;
+    }
+
+    int num_bytes = (left < run * BLOCK_SIZE) ? left : run * BLOCK_SIZE;
+
+    if (archive_write(ar, file_data(inode_idx, i), num_bytes) == -1)
+    {
+      return -1;
+    }
+
+    left -= num_bytes;
+    i += run;
+  }
+
+  stats_bytes(inode->size);
+
+  return archive_pad(ar, TAR_BLOCK);
+}
+
+//write every file into a ustar archive at path, in directory order.
+//Returns the number of files written or -1.
+int export_image (char *path)
+{
+  struct archive ar = { -1, archive_buf, 0, 0, 0 };
+  int files = 0;
+  int status = 0;
+
+  ar.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (ar.fd == -1)
+  {
+    perror("export: Opening the archive returned");
+    return -1;
+  }
+
+  for (int d = 0; d < NUM_FILES && status == 0; d++)
+  {
+    if (mnt->directory_ptr[d].valid == 1)
+    {
+      status = export_file(&ar, d);
+      files++;
+    }
+  }
+
+  //two zero blocks end the archive, which is rounded up to whole records
+  if (status == 0)
+  {
+    status = archive_write(&ar, tar_zeros, TAR_BLOCK * 2);
+  }
+  if (status == 0)
+  {
+    status = archive_pad(&ar, TAR_RECORD);
+  }
+  if (status == 0)
+  {
+    status = archive_flush(&ar);
+  }
+
+  if (status == -1)
+  {
+    perror("export: Writing the archive returned");
+  }
+
+  close(ar.fd);
+
+  return (status == -1) ? -1 : files;
+}
+
+//create name from the next size bytes of the archive.  Returns 1 if the
+//file was imported, 0 if it was skipped and -1 if the archive ended early.
+int import_file (struct archive *ar, char *name, int size, int mode, time_t mtime, int hidden)
+{
+  int block_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  char *skip = NULL;
+
+  if (strlen(name) == 0 || strlen(name) > MAX_FILE_NAME)
+  {
+    skip = "name too long";
+  }
+  else if (find_file_dir_idx(name) != -1)
+  {
+    skip = "already exists";
+  }
+  else if (block_count > mnt->free_blocks + mnt->reclaimable_blocks)
+  {
+    skip = "not enough disk space";
+  }
+
+  int dir_idx = -1;
+  int inode_idx = -1;
+
+  if (skip == NULL)
+  {
+    reclaim_blocks(block_count);
+    dir_idx = findFreeDirectoryEntry();
+    inode_idx = (dir_idx == -1) ? -1 : findFreeInode();
+    if (inode_idx == -1)
+    {
+      skip = "no free directory entries or inodes";
+    }
+  }
+
+  if (skip == NULL)
+  {
+    for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+    {
+      mnt->inode_array_ptr[inode_idx]->blocks[i] = -1;
+    }
+
+    if (alloc_file_blocks(inode_idx, block_count) == -1)
+    {
+      skip = "not enough disk space";
+    }
+  }
+
+  if (skip != NULL)
+  {
+    printf("import: Skipped %s, %s\n", name, skip);
+    return (archive_read(ar, NULL, size) == (size_t) size) ? 0 : -1;
+  }
+
+  //read each run of consecutive blocks in place
+  int *blocks = mnt->inode_array_ptr[inode_idx]->blocks;
+  int left = size;
+
+  for (int i = 0; i < block_count; )
+  {
+    int run = 1;
+    while (i + run < block_count && blocks[i + run] == blocks[i] + run)
+    {
+      run++;
+    }
+
+    int num_bytes = (left < run * BLOCK_SIZE) ? left : run * BLOCK_SIZE;
+
+    if (archive_read(ar, mnt->data_blocks[blocks[i]], num_bytes) != (size_t) num_bytes)
+    {
+      for (int j = 0; j < block_count; j++)
+      {
+        release_block(blocks[j]);
+        blocks[j] = -1;
+      }
+      return -1;
+    }
+
+    for (int j = i; j < i + run; j++)
+    {
+      mark_dirty(blocks[j]);
+    }
+
+    left -= num_bytes;
+    i += run;
+  }
+
+  mnt->directory_ptr[dir_idx].name = name_dup(name);
+  mnt->directory_ptr[dir_idx].inode_idx = inode_idx;
+  mnt->directory_ptr[dir_idx].hidden = hidden;
+  mnt->directory_ptr[dir_idx].read_only = (mode & 0222) ? 0 : 1;
+  mnt->directory_ptr[dir_idx].valid = 1;
+
+  mnt->inode_array_ptr[inode_idx]->valid = 1;
+  mnt->inode_array_ptr[inode_idx]->size = size;
+  mnt->inode_array_ptr[inode_idx]->date = mtime;
+
+  mark_dirty(0);
+  mark_inode_dirty(inode_idx);
+
+  list_index_insert(dir_idx);
+
+  stats_bytes(size);
+
+  return 1;
+}
+
+//add every regular file in the ustar archive at path.  The file system
+//is flat, so only the last part of a member's path is used as its name.
+//Returns the number of files imported or -1.
+int import_image (char *path)
+{
+  struct archive ar = { -1, archive_buf, 0, 0, 0 };
+  struct tar_header hdr;
+  int files = 0;
+  int hidden = 0;
+  int status = 0;
+
+  ar.fd = open(path, O_RDONLY);
+  if (ar.fd == -1)
+  {
+    perror("import: Opening the archive returned");
+    return -1;
+  }
+
+  while (status == 0)
+  {
+    if (archive_read(&ar, &hdr, TAR_BLOCK) != TAR_BLOCK)
+    {
+      status = -1;
+      break;
+    }
+
+    //a zero block marks the end of the archive
+    if (hdr.name[0] == '\0' && tar_parse_octal(hdr.chksum, sizeof(hdr.chksum)) == 0)
+    {
+      break;
+    }
+
+    if (tar_parse_octal(hdr.chksum, sizeof(hdr.chksum)) != tar_checksum(&hdr))
+    {
+      status = -1;
+      break;
+    }
+
+    unsigned long size = tar_parse_octal(hdr.size, sizeof(hdr.size));
+    size_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+    if (hdr.typeflag == 'x' && size < ARCHIVE_BUFFER)
+    {
+      //pax records for the next member, only hidden matters here
+      static char records[ARCHIVE_BUFFER];
+
+      if (archive_read(&ar, records, padded) != padded)
+      {
+        status = -1;
+        break;
+      }
+      records[size] = '\0';
+      hidden = (strstr(records, " " PAX_HIDDEN "=1\n") != NULL);
+      continue;
+    }
+
+    if (hdr.typeflag == '0' || hdr.typeflag == '\0')
+    {
+      char full[TAR_NAME_SIZE + 1];
+      char *name;
+
+      memcpy(full, hdr.name, TAR_NAME_SIZE);
+      full[TAR_NAME_SIZE] = '\0';
+      name = strrchr(full, '/') ? strrchr(full, '/') + 1 : full;
+
+      if (size > (unsigned long) MAX_BLOCKS_PER_FILE * BLOCK_SIZE)
+      {
+        printf("import: Skipped %s, too large\n", name);
+      }
+      else
+      {
+        int imported = import_file(&ar, name, size,
+                                   tar_parse_octal(hdr.mode, sizeof(hdr.mode)),
+                                   tar_parse_octal(hdr.mtime, sizeof(hdr.mtime)), hidden);
+        if (imported == -1)
+        {
+          status = -1;
+          break;
+        }
+
+        files += imported;
+        padded -= size;
+      }
+    }
+
+    hidden = 0;
+
+    //anything else, directories and links, is skipped
+    if (archive_read(&ar, NULL, padded) != padded)
+    {
+      status = -1;
+    }
+  }
+
+  if (status == -1)
+  {
+    printf("import: %s is damaged or ends early\n", path);
+  }
+
+  close(ar.fd);
+
+  return (status == -1) ? -1 : files;
+}
+
+//fill in the name table from the directory and the tombstone list
+void build_image_names (struct image_names *names)
+{
+  memset(names, 0, sizeof(struct image_names));
+  names->magic = IMAGE_MAGIC;
+
+  for (int i = 0; i < NUM_FILES; i++)
+  {
+    if (mnt->directory_ptr[i].valid == 1 && mnt->directory_ptr[i].name != NULL)
+    {
+      strncpy(names->dir_names[i], mnt->directory_ptr[i].name, MAX_FILE_NAME);
+    }
+  }
+
+  int n = 0;
+  for (int i = mnt->tombstone_head; i != -1; i = mnt->tombstones[i].next)
+  {
+    strncpy(names->tomb_names[i], mnt->tombstones[i].name, MAX_FILE_NAME);
+    names->tomb_hidden[i] = mnt->tombstones[i].hidden;
+    names->tomb_read_only[i] = mnt->tombstones[i].read_only;
+    names->tomb_order[n++] = i;
+  }
+
+  if (n < NUM_INODES)
+  {
+    names->tomb_order[n] = -1;
+  }
+}
+
+//write every dirty block back to the image.  Adjacent dirty blocks go
+//out as one write of up to FLUSH_MAX_RUN blocks.  Each run is copied to
+//a private buffer under fs_lock and written without it, so commands can
+//keep changing blocks; a block changed again is simply dirty again.
+//Called with fs_lock held.  Returns 0 or -1 if a write failed.
+int flush_dirty()
+{
+  unsigned char *buffer = mnt->flush_buffer;
+  struct image_names *names = &mnt->flush_names;
+  int metadata = 0;
+  int block = 0;
+
+  //aligned so the runs can be written with O_DIRECT
+  if (buffer == NULL &&
+      posix_memalign((void **) &mnt->flush_buffer, DIRECT_ALIGN, (size_t) FLUSH_MAX_RUN * BLOCK_SIZE) != 0)
+  {
+    return -1;
+  }
+  buffer = mnt->flush_buffer;
+
+  while ((block = next_dirty(block)) != -1)
+  {
+    int run = 1;
+    while (block + run < NUM_BLOCKS && run < FLUSH_MAX_RUN && is_dirty(block + run))
+    {
+      run++;
+    }
+
+    for (int i = block; i < block + run; i++)
+    {
+      clear_dirty(i);
+    }
+
+    if (block < 130)
+    {
+      metadata = 1;
+    }
+
+    memcpy(buffer, mnt->data_blocks[block], (size_t) run * BLOCK_SIZE);
+
+    int fds[MAX_STRIPES];
+    image_data_fds(fds);
+    TRACE_START(trace_start);
+
+    mnt->flush_first = block;
+    mnt->flush_run = run;
+
+    pthread_mutex_unlock(&fs_lock);
+    int status = image_block_io(fds, 1, buffer, block, run);
+    pthread_mutex_lock(&fs_lock);
+
+    mnt->flush_run = 0;
+
+    TRACE_END("flush_run", trace_start, "block", block, "blocks", run);
+
+    if (status == -1)
+    {
+      for (int i = block; i < block + run; i++)
+      {
+        mark_dirty(i);
+      }
+      return -1;
+    }
+
+    STATS_ADD(flush_writes, 1);
+    STATS_ADD(flush_blocks, run);
+    block += run;
+  }
+
+  //the names only change along with the directory or an inode
+  if (metadata)
+  {
+    build_image_names(names);
+
+    int fd = mnt->image_fd;
+
+    pthread_mutex_unlock(&fs_lock);
+    int status = pwrite_full(fd, names, sizeof(*names), (off_t) NUM_BLOCKS * BLOCK_SIZE);
+    pthread_mutex_lock(&fs_lock);
+
+    if (status == -1)
+    {
+      mark_dirty(0);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void *flush_loop (void *arg)
+{
+  mnt = (struct mount *) arg;
+
+  pthread_mutex_lock(&fs_lock);
+
+  while (mnt->flush_running)
+  {
+    int background = (NUM_BLOCKS * dirty_background_ratio) / 100;
+
+    if (mnt->dirty_count <= background && mnt->sync_completed == mnt->sync_ticket)
+    {
+      struct timespec deadline;
+
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += dirty_expire_secs;
+
+      //woken early for a sync, a stop or more dirty blocks, go look again
+      if (pthread_cond_timedwait(&mnt->flush_wake, &fs_lock, &deadline) != ETIMEDOUT ||
+          mnt->dirty_count == 0)
+      {
+        continue;
+      }
+    }
+
+    int serving = mnt->sync_ticket;
+    int status = flush_dirty();
+
+    if (status == -1)
+    {
+      mnt->flush_error = 1;
+      perror("flush: Writing the image failed");
+    }
+
+    if (serving != mnt->sync_completed && (mnt->dirty_count == 0 || status == -1))
+    {
+      int fds[MAX_STRIPES];
+      int members = mnt->stripe_count;
+      image_data_fds(fds);
+
+      TRACE_START(trace_start);
+
+      pthread_mutex_unlock(&fs_lock);
+      for (int m = 0; m < members; m++)
+      {
+        if (fsync(fds[m]) == -1) status = -1;
+      }
+      pthread_mutex_lock(&fs_lock);
+
+      TRACE_END("fsync", trace_start, "ticket", serving, "status", status);
+
+      if (status == -1) mnt->flush_error = 1;
+      mnt->sync_completed = serving;
+      pthread_cond_broadcast(&mnt->flush_done);
+    }
+  }
+
+  pthread_mutex_unlock(&fs_lock);
+
+  return NULL;
+}
+
+void flusher_start()
+{
+  mnt->flush_running = 1;
+  if (pthread_create(&mnt->flush_thread, NULL, flush_loop, mnt) != 0)
+  {
+    mnt->flush_running = 0;
+    printf("Error: Could not start the flusher thread\n");
+  }
+}
+
+//called with fs_lock held
+void flusher_stop()
+{
+  if (mnt->flush_running)
+  {
+    mnt->flush_running = 0;
+    pthread_cond_signal(&mnt->flush_wake);
+    pthread_mutex_unlock(&fs_lock);
+    pthread_join(mnt->flush_thread, NULL);
+    pthread_mutex_lock(&fs_lock);
+  }
+}
+
+//take over the members 1 and up of a striped image
+void stripes_set (struct image_stripes *stripes, int *fds, int count, int unit)
+{
+  mnt->stripe_count = count;
+  mnt->stripe_unit = unit;
+
+  for (int m = 1; m < count; m++)
+  {
+    mnt->stripe_fd[m] = fds[m];
+    mnt->stripe_direct_fd[m] = -1;
+    mnt->stripe_path[m] = strdup(stripes->paths[m]);
+  }
+}
+
+void stripes_close()
+{
+  for (int m = 1; m < mnt->stripe_count; m++)
+  {
+    close(mnt->stripe_fd[m]);
+    free(mnt->stripe_path[m]);
+    mnt->stripe_path[m] = NULL;
+  }
+
+  mnt->stripe_count = 1;
+}
+
+//wait until every block dirtied so far is on disk.  Called with fs_lock
+//held.  Returns 0 or -1 if writeback failed.
+int image_sync()
+{
+  if (mnt->image_fd == -1)
+  {
+    return 0;
+  }
+
+  if (!mnt->flush_running)
+  {
+    int status = flush_dirty();
+    if (fsync(mnt->image_fd) == -1) status = -1;
+    for (int m = 1; m < mnt->stripe_count; m++)
+    {
+      if (fsync(mnt->stripe_fd[m]) == -1) status = -1;
+    }
+    return status;
+  }
+
+  int ticket = ++mnt->sync_ticket;
+
+  mnt->flush_error = 0;
+  pthread_cond_signal(&mnt->flush_wake);
+
+  while (mnt->sync_completed < ticket)
+  {
+    pthread_cond_wait(&mnt->flush_done, &fs_lock);
+  }
+
+  return mnt->flush_error ? -1 : 0;
+}
+
+//sync and detach the current image
+void image_close()
+{
+  if (mnt->image_fd == -1)
+  {
+    return;
+  }
+
+  if (image_sync() == -1)
+  {
+    printf("Error: Not every block could be written to %s\n", mnt->image_path);
+  }
+
+  flusher_stop();
+  prefetch_drain();
+  image_set_direct(0);
+  close(mnt->image_fd);
+  mnt->image_fd = -1;
+  free(mnt->image_path);
+  mnt->image_path = NULL;
+  stripes_close();
+}
+
+//forget everything held in memory about the current file system
+void fs_reset()
+{
+  for (int i = 0; i < NUM_FILES; i++)
+  {
+    if (mnt->directory_ptr != NULL && mnt->directory_ptr[i].valid != 0)
+    {
+      name_free(mnt->directory_ptr[i].name);
+    }
+  }
+
+  while (mnt->tombstone_head != -1)
+  {
+    int i = mnt->tombstone_head;
+    name_free(mnt->tombstones[i].name);
+    tombstone_unlink(i);
+  }
+
+  for (int fd = 0; fd < MAX_OPEN_FILES; fd++)
+  {
+    name_free(mnt->open_files[fd].name);
+    mnt->open_files[fd].name = NULL;
+  }
+
+  mnt->list_index_count = 0;
+  mnt->defrag_cursor = 0;
+  mnt->txn_active = 0;
+  memset(mnt->dirty_bitmap, 0, sizeof(mnt->dirty_bitmap));
+  mnt->dirty_count = 0;
+  memset(mnt->block_hashed, 0, sizeof(mnt->block_hashed));
+}
+
+//create a new empty file system backed by the image at path, striped
+//over the image and the count - 1 files in members in units of unit
+//blocks when count is above 1
+int image_create (char *path, int unit, char **members, int count)
+{
+  static struct image_stripes stripes;
+  int fds[MAX_STRIPES];
+  int unit_count = (NUM_BLOCKS + unit - 1) / unit;
+  off_t member_size = (off_t) ((unit_count + count - 1) / count) * unit * BLOCK_SIZE;
+
+  for (int m = 0; m < count; m++)
+  {
+    char *member = (m == 0) ? path : members[m - 1];
+    off_t size = (m == 0) ? (off_t) NUM_BLOCKS * BLOCK_SIZE +
+                            (off_t) (sizeof(struct image_names) +
+                                     (count > 1 ? sizeof(struct image_stripes) : 0))
+                          : member_size;
+
+    fds[m] = open(member, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fds[m] == -1 || ftruncate(fds[m], size) == -1)
+    {
+      printf("createfs: %s: %s\n", member, strerror(errno));
+      for (int j = 0; j <= m; j++)
+      {
+        if (fds[j] != -1) close(fds[j]);
+      }
+      return -1;
+    }
+
+    if (m > 0)
+    {
+      snprintf(stripes.paths[m], PATH_MAX_LEN, "%s", member);
+    }
+  }
+
+  if (count > 1)
+  {
+    stripes.magic = STRIPE_MAGIC;
+    stripes.count = count;
+    stripes.unit = unit;
+
+    if (pwrite_full(fds[0], &stripes, sizeof(stripes),
+                    (off_t) NUM_BLOCKS * BLOCK_SIZE + sizeof(struct image_names)) == -1)
+    {
+      perror("createfs: Writing the stripe table returned");
+      for (int m = 0; m < count; m++)
+      {
+        close(fds[m]);
+      }
+      return -1;
+    }
+  }
+
+  image_close();
+  fs_reset();
+  init();
+
+  mnt->image_fd = fds[0];
+  mnt->image_path = strdup(path);
+  stripes_set(&stripes, fds, count, unit);
+  image_set_direct(direct_io);
+  flusher_start();
+
+  return image_sync();
+}
+
+//load the file system stored in the image at path
+int image_open (char *path)
+{
+  static struct image_names names;
+  static struct image_stripes stripes;
+  int fds[MAX_STRIPES];
+  int count = 1;
+  int fd = open(path, O_RDWR);
+
+  if (fd == -1)
+  {
+    perror("openfs: Opening the image returned");
+    return -1;
+  }
+
+  if (pread_full(fd, &names, sizeof(names), (off_t) NUM_BLOCKS * BLOCK_SIZE) == -1 ||
+      names.magic != IMAGE_MAGIC)
+  {
+    printf("openfs: %s is not a file system image\n", path);
+    close(fd);
+    return -1;
+  }
+
+  //a striped image names its other members after the name table
+  fds[0] = fd;
+  if (pread_full(fd, &stripes, sizeof(stripes), (off_t) NUM_BLOCKS * BLOCK_SIZE + sizeof(names)) == 0 &&
+      stripes.magic == STRIPE_MAGIC && stripes.count > 1 && stripes.count <= MAX_STRIPES &&
+      stripes.unit > 0)
+  {
+    for (count = 1; count < stripes.count; count++)
+    {
+      stripes.paths[count][PATH_MAX_LEN - 1] = '\0';
+      fds[count] = open(stripes.paths[count], O_RDWR);
+
+      if (fds[count] == -1)
+      {
+        printf("openfs: Stripe %s: %s\n", stripes.paths[count], strerror(errno));
+        for (int m = 0; m < count; m++)
+        {
+          close(fds[m]);
+        }
+        return -1;
+      }
+    }
+  }
+
+  image_close();
+  fs_reset();
+  stripes_set(&stripes, fds, count, stripes.unit);
+
+  //only the directory and the inodes are read now, data blocks are
+  //read the first time something needs them
+  if (image_block_io(fds, 0, mnt->data_blocks, 0, 130) == -1)
+  {
+    perror("openfs: Reading the image returned");
+    close(fd);
+    stripes_close();
+    init();
+    return -1;
+  }
+
+  memset(mnt->block_state, BLOCK_LOADED, 130);
+  memset(mnt->block_state + 130, BLOCK_MISSING, NUM_BLOCKS - 130);
+
+  mnt->directory_ptr = (struct directory_entry *) &mnt->data_blocks[0];
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    mnt->inode_array_ptr[i] = (struct inode *) &mnt->data_blocks[i + 1];
+    mnt->ra_next[i] = 0;
+    mnt->ra_window[i] = 0;
+    mnt->ra_issued[i] = 0;
+  }
+
+  //files of a transaction that never committed are dropped.  Once the
+  //directory entry is live its inode is too, whatever the inode block
+  //got to before the image was last written.
+  for (int i = 0; i < NUM_FILES; i++)
+  {
+    int inode_idx = mnt->directory_ptr[i].inode_idx;
+    int inode_ok = (inode_idx >= 0 && inode_idx < NUM_INODES);
+
+    if (mnt->directory_ptr[i].valid == ENTRY_STAGED)
+    {
+      mnt->directory_ptr[i].valid = 0;
+      if (inode_ok) mnt->inode_array_ptr[inode_idx]->valid = 0;
+    }
+    else if (mnt->directory_ptr[i].valid == 1 && inode_ok &&
+             mnt->inode_array_ptr[inode_idx]->valid == ENTRY_STAGED)
+    {
+      mnt->inode_array_ptr[inode_idx]->valid = 1;
+    }
+  }
+
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    if (mnt->inode_array_ptr[i]->valid == ENTRY_STAGED)
+    {
+      mnt->inode_array_ptr[i]->valid = 0;
+    }
+  }
+
+  for (int i = 0; i < 130; i++)
+  {
+    mnt->used_blocks[i] = 1;
+  }
+  for (int i = 130; i < NUM_BLOCKS; i++)
+  {
+    mnt->used_blocks[i] = 0;
+  }
+
+  //new slices start a fresh pack block rather than finding the end of an old one
+  mnt->pack_block = -1;
+  mnt->pack_sparse = 1;
+  memset(mnt->pack_blocks, 0, sizeof(mnt->pack_blocks));
+
+  for (int i = 0; i < NUM_FILES; i++)
+  {
+    mnt->directory_ptr[i].name = NULL;
+    if (mnt->directory_ptr[i].valid == 1)
+    {
+      mnt->directory_ptr[i].name = name_dup(names.dir_names[i]);
+    }
+  }
+
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    mnt->tombstones[i].name = NULL;
+  }
+
+  for (int n = 0; n < NUM_INODES && names.tomb_order[n] != -1; n++)
+  {
+    int i = names.tomb_order[n];
+
+    mnt->tombstones[i].name = name_dup(names.tomb_names[i]);
+    mnt->tombstones[i].hidden = names.tomb_hidden[i];
+    mnt->tombstones[i].read_only = names.tomb_read_only[i];
+    mnt->tombstones[i].next = -1;
+    mnt->tombstones[i].prev = mnt->tombstone_tail;
+    if (mnt->tombstone_tail != -1) mnt->tombstones[mnt->tombstone_tail].next = i;
+    else mnt->tombstone_head = i;
+    mnt->tombstone_tail = i;
+  }
+
+  //a block is in use if a live or a deleted file still maps it.  Map
+  //entries outside the data area are skipped and left for fsck.
+  mnt->reclaimable_blocks = 0;
+  for (int i = 0; i < NUM_INODES; i++)
+  {
+    if (mnt->inode_array_ptr[i]->valid == 1 || mnt->tombstones[i].name != NULL)
+    {
+      int *blocks = mnt->inode_array_ptr[i]->blocks;
+
+      for (int j = 0; j < MAX_BLOCKS_PER_FILE && blocks[j] != -1; j++)
+      {
+        if (blocks[j] >= 130 && blocks[j] < NUM_BLOCKS)
+        {
+          mnt->used_blocks[blocks[j]]++;
+          mnt->pack_blocks[blocks[j]] |= (mnt->inode_array_ptr[i]->packed != 0);
+        }
+      }
+
+      if (mnt->inode_array_ptr[i]->valid == 0)
+      {
+        mnt->reclaimable_blocks += inode_block_count(i);
+      }
+    }
+  }
+
+  extent_rebuild();
+
+  for (int i = 0; i < NUM_FILES; i++)
+  {
+    if (mnt->directory_ptr[i].valid == 1)
+    {
+      list_index_insert(i);
+    }
+  }
+
+  mnt->image_fd = fd;
+  mnt->image_path = strdup(path);
+  image_set_direct(direct_io);
+  flusher_start();
+  prefetch_start();
+
+  return 0;
+}
+
+//set up an empty mount with a new in memory file system and make it
+//the current one.  Returns the mount or NULL if memory ran out.
+struct mount *mount_new (char *alias)
+{
+  struct mount *m = calloc(1, sizeof(struct mount));
+
+  if (m == NULL)
+  {
+    return NULL;
+  }
+
+  m->data_blocks = mmap(NULL, (size_t) NUM_BLOCKS * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m->data_blocks == MAP_FAILED)
+  {
+    free(m);
+    return NULL;
+  }
+
+  m->alias = (alias != NULL) ? strdup(alias) : NULL;
+  m->tombstone_head = -1;
+  m->tombstone_tail = -1;
+  m->image_fd = -1;
+  m->image_direct_fd = -1;
+  m->stripe_count = 1;
+  pthread_cond_init(&m->flush_wake, NULL);
+  pthread_cond_init(&m->flush_done, NULL);
+  pthread_cond_init(&m->prefetch_wake, NULL);
+
+  mnt = m;
+  init();
+
+  return m;
+}
+
+//write back and release the current mount.  Called with fs_lock held.
+void mount_free()
+{
+  struct mount *m = mnt;
+
+  image_close();
+  prefetch_stop();
+  fs_reset();
+
+  munmap(m->data_blocks, (size_t) NUM_BLOCKS * BLOCK_SIZE);
+  free(m->flush_buffer);
+  pthread_cond_destroy(&m->flush_wake);
+  pthread_cond_destroy(&m->flush_done);
+  pthread_cond_destroy(&m->prefetch_wake);
+  free(m->alias);
+  free(m);
+
+  mnt = NULL;
+}
+
+struct mount *find_mount (char *alias)
+{
+  for (int m = 1; m < MAX_MOUNTS; m++)
+  {
+    if (mounts[m] != NULL && !strcmp(mounts[m]->alias, alias))
+    {
+      return mounts[m];
+    }
+  }
+
+  return NULL;
+}
+
+//point mnt at the mount the command's arguments name.  An argument
+//alias:name names a file on a mounted image and loses its prefix, a
+//bare alias: only picks the mount and is dropped.  Arguments naming
+//two different mounts are refused.  Returns 0 or -1.
+int select_mount (char **token, int *token_count)
+{
+  struct mount *chosen = NULL;
+
+  mnt = mounts[0];
+
+  for (int i = 1; i < *token_count; i++)
+  {
+    char *colon = (token[i] != NULL) ? strchr(token[i], ':') : NULL;
+
+    if (colon == NULL)
+    {
+      continue;
+    }
+
+    *colon = '\0';
+    struct mount *m = find_mount(token[i]);
+    *colon = ':';
+
+    if (m == NULL)
+    {
+      continue;
+    }
+
+    if (chosen != NULL && chosen != m)
+    {
+      return -1;
+    }
+    chosen = m;
+
+    memmove(token[i], colon + 1, strlen(colon + 1) + 1);
+
+    if (token[i][0] == '\0')
+    {
+      for (int j = i; j < *token_count - 1; j++)
+      {
+        token[j] = token[j + 1];
+      }
+      (*token_count)--;
+      token[*token_count] = NULL;
+      i--;
+    }
+  }
+
+  if (chosen != NULL)
+  {
+    mnt = chosen;
+  }
+
+  return 0;
+}
+
+//number of data blocks loaded from the images of all mounts.  The
+//prefetcher changes block states under cache_lock, so call with it held.
+int cache_loaded_blocks()
+{
+  int loaded = 0;
+
+  for (int m = 0; m < MAX_MOUNTS; m++)
+  {
+    if (mounts[m] == NULL || mounts[m]->image_fd == -1)
+    {
+      continue;
+    }
+
+    for (int b = 130; b < NUM_BLOCKS; b++)
+    {
+      if (mounts[m]->block_state[b] == BLOCK_LOADED)
+      {
+        loaded++;
+      }
+    }
+  }
+
+  return loaded;
+}
+
+//evict clean data blocks until the mounts are back within the cache
+//budget.  The clock hand sweeps the blocks of every image backed mount
+//in turn; a block used since the hand last passed it is spared once.
+//Metadata, dirty blocks and blocks being read are never evicted.  Runs
+//between commands with fs_lock held, so no command holds a pointer
+//into a block.
+void cache_trim()
+{
+  int budget = 2 * MAX_MOUNTS * NUM_BLOCKS;   //two full sweeps at most
+  struct mount *saved = mnt;
+
+  pthread_mutex_lock(&cache_lock);
+
+  int excess = cache_loaded_blocks() - cache_budget;
+
+  while (excess > 0 && budget-- > 0)
+  {
+    struct mount *m = mounts[clock_mount];
+    int b = clock_block;
+
+    if (++clock_block == NUM_BLOCKS)
+    {
+      clock_block = 130;
+      clock_mount = (clock_mount + 1) % MAX_MOUNTS;
+    }
+
+    if (m == NULL || m->image_fd == -1 || m->block_state[b] != BLOCK_LOADED)
+    {
+      continue;
+    }
+
+    mnt = m;
+    if (is_dirty(b) || (b >= m->flush_first && b < m->flush_first + m->flush_run))
+    {
+      continue;
+    }
+
+    if (m->block_ref[b])
+    {
+      m->block_ref[b] = 0;
+      continue;
+    }
+
+    m->block_state[b] = BLOCK_MISSING;
+    madvise(m->data_blocks[b], BLOCK_SIZE, MADV_DONTNEED);
+    STATS_ADD(cache_evictions, 1);
+    excess--;
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+
+  mnt = saved;
+}
+
+//show how the accesses spread over the blocks in use and which files are
+//hottest, or block by block for one file.  A block is in memory or only
+//in the image it is read from on the next access.
+void heat_print (char *filename)
+{
+  if (filename != NULL)
+  {
+    int dir_idx = find_file_dir_idx(filename);
+
+    if (dir_idx == -1)
+    {
+      printf("heat: File not found\n");
+      return;
+    }
+
+    int inode_idx = mnt->directory_ptr[dir_idx].inode_idx;
+    int *blocks = mnt->inode_array_ptr[inode_idx]->blocks;
+
+    printf("%s: heat %u\n%6s %6s %6s  %s\n", filename, mnt->file_heat[inode_idx],
+           "entry", "block", "heat", "in memory");
+
+    for (int i = 0; i < inode_block_count(inode_idx); i++)
+    {
+      printf("%6d %6d %6u  %s\n", i, blocks[i], mnt->block_heat[blocks[i]],
+             mnt->block_state[blocks[i]] == BLOCK_LOADED ? "yes" : "no");
+    }
+    return;
+  }
+
+  //bucket 0 is heat 0, bucket k is heat 2^(k-1) to 2^k - 1
+  int blocks[18] = { 0 };
+  int loaded[18] = { 0 };
+
+  for (int b = 130; b < NUM_BLOCKS; b++)
+  {
+    if (mnt->used_blocks[b] == 0)
+    {
+      continue;
+    }
+
+    int bucket = 0;
+    while ((mnt->block_heat[b] >> bucket) != 0)
+    {
+      bucket++;
+    }
+
+    blocks[bucket]++;
+    if (mnt->block_state[b] == BLOCK_LOADED)
+    {
+      loaded[bucket]++;
+    }
+  }
+
+  printf("%-12s %8s %10s\n", "heat", "blocks", "in memory");
+  for (int k = 0; k < 18; k++)
+  {
+    char range[24];
+
+    if (blocks[k] == 0)
+    {
+      continue;
+    }
+
+    if (k <= 1) snprintf(range, sizeof(range), "%d", k);
+    else snprintf(range, sizeof(range), "%d-%d", 1 << (k - 1), (1 << k) - 1);
+
+    printf("%-12s %8d %10d\n", range, blocks[k], loaded[k]);
+  }
+
+  //pick the hottest files by repeated selection, there are few
+  int top[HEAT_TOP_FILES];
+  int shown = 0;
+
+  printf("\n%10s %8s %10s  %s\n", "heat", "blocks", "in memory", "file");
+
+  while (shown < HEAT_TOP_FILES)
+  {
+    int best = -1;
+
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+      int taken = 0;
+
+      if (mnt->directory_ptr[i].valid != 1)
+      {
+        continue;
+      }
+
+      for (int t = 0; t < shown; t++)
+      {
+        taken |= (top[t] == i);
+      }
+
+      if (!taken && (best == -1 || mnt->file_heat[mnt->directory_ptr[i].inode_idx] >
+                                   mnt->file_heat[mnt->directory_ptr[best].inode_idx]))
+      {
+        best = i;
+      }
+    }
+
+    if (best == -1 || mnt->file_heat[mnt->directory_ptr[best].inode_idx] == 0)
+    {
+      break;
+    }
+
+    int inode_idx = mnt->directory_ptr[best].inode_idx;
+    int count = inode_block_count(inode_idx);
+    int in_memory = 0;
+
+    for (int j = 0; j < count; j++)
+    {
+      in_memory += (mnt->block_state[mnt->inode_array_ptr[inode_idx]->blocks[j]] == BLOCK_LOADED);
+    }
+
+    printf("%10u %8d %10d  %s\n", mnt->file_heat[inode_idx], count, in_memory,
+           mnt->directory_ptr[best].name);
+    top[shown++] = best;
+  }
+}
+
+//write a whole file out to the host with direct I/O, one write per
+//run of consecutive blocks.  Returns 0, or -1 if the host file could
+//not be opened for direct I/O and the caller should fall back.
+int get_file_direct (int inode_idx, char *path)
+{
+  //a packed file's slice is not block aligned
+  if (mnt->inode_array_ptr[inode_idx]->packed)
+  {
+    return -1;
+  }
+
+  int fd = open_direct(path, O_WRONLY | O_CREAT | O_TRUNC);
+
+  if (fd == -1)
+  {
+    return -1;
+  }
+
+  int *blocks = mnt->inode_array_ptr[inode_idx]->blocks;
+  int size = mnt->inode_array_ptr[inode_idx]->size;
+  int count = inode_block_count(inode_idx);
+  int offset = 0;
+  int i = 0;
+
+  printf("Writing %d bytes to %s\n", size, path );
+  stats_bytes(size);
+
+  while (i < count)
+  {
+    int run = 1;
+    while (i + run < count && blocks[i + run] == blocks[i] + run)
+    {
+      run++;
+    }
+
+    for (int j = i; j < i + run; j++)
+    {
+      block_read_access(inode_idx, j);
+    }
+
+    int num_bytes = run * BLOCK_SIZE;
+    if (size - offset < num_bytes)
+    {
+      num_bytes = size - offset;
+    }
+
+    TRACE_START(trace_start);
+
+    if (pwrite_direct(fd, mnt->data_blocks[blocks[i]], num_bytes, offset) == -1)
+    {
+      perror("get: Writing the output file returned");
+      break;
+    }
+
+    TRACE_END("get_write", trace_start, "block", blocks[i], "bytes", num_bytes);
+
+    offset += num_bytes;
+    i += run;
+  }
+
+  close(fd);
+
+  return 0;
+}
+
+//turn "3" or "#3" into the index of an open handle, -1 if it isn't one
+int parse_handle (char *token)
+{
+  char *end;
+
+  if (token == NULL)
+  {
+    return -1;
+  }
+
+  if (token[0] == '#')
+  {
+    token++;
+  }
+
+  long fd = strtol(token, &end, 10);
+
+  if (*token == '\0' || *end != '\0' || fd < 0 || fd >= MAX_OPEN_FILES ||
+      mnt->open_files[fd].name == NULL)
+  {
+    return -1;
+  }
+
+  return fd;
+}
+
+//the only open handle, for commands that may leave the handle out
+int single_open_handle()
+{
+  int found = -1;
+
+  for (int fd = 0; fd < MAX_OPEN_FILES; fd++)
+  {
+    if (mnt->open_files[fd].name != NULL)
+    {
+      if (found != -1)
+      {
+        return -1;
+      }
+      found = fd;
+    }
+  }
+
+  return found;
+}
+
+int file_is_open (int dir_idx)
+{
+  for (int fd = 0; fd < MAX_OPEN_FILES; fd++)
+  {
+    if (mnt->open_files[fd].name != NULL && mnt->open_files[fd].dir_idx == dir_idx)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+//move a file to the tombstone list.  The inode keeps its block map, its
+//blocks are only released by a later reclaim pass.
+void file_delete (int dir_idx)
+{
+  int inode_idx = mnt->directory_ptr[dir_idx].inode_idx;
+
+  list_index_remove(dir_idx);
+  tombstone_add(dir_idx);
+
+  mnt->directory_ptr[dir_idx].valid = 0;
+  mnt->directory_ptr[dir_idx].name = NULL;
+  mnt->inode_array_ptr[inode_idx]->valid = 0;
+
+  mark_dirty(0);
+  mark_inode_dirty(inode_idx);
+}
+
+//whether the live file in directory entry dir_idx goes at commit
+int txn_deleting (int dir_idx)
+{
+  return mnt->txn_active && mnt->txn_del[mnt->directory_ptr[dir_idx].inode_idx];
+}
+
+void txn_begin()
+{
+  mnt->txn_active = 1;
+  memset(mnt->txn_del, 0, sizeof(mnt->txn_del));
+  memset(mnt->txn_hidden, -1, sizeof(mnt->txn_hidden));
+  memset(mnt->txn_read_only, -1, sizeof(mnt->txn_read_only));
+}
+
+//make everything the transaction did visible at once.  The staged files
+//are written out first, then the directory block that makes them live
+//is, so only one sync sees the switch.  Returns 0 or -1, the
+//transaction stays open when it could not commit.
+int txn_commit()
+{
+  for (int d = 0; d < NUM_FILES; d++)
+  {
+    if (mnt->directory_ptr[d].valid == 1 && txn_deleting(d) && file_is_open(d))
+    {
+      printf("commit: %s is open, close it first\n", mnt->directory_ptr[d].name);
+      return -1;
+    }
+  }
+
+  //a staged file may not take the name of a file that stays
+  for (int d = 0; d < NUM_FILES; d++)
+  {
+    if (mnt->directory_ptr[d].valid != ENTRY_STAGED)
+    {
+      continue;
+    }
+
+    for (int e = 0; e < NUM_FILES; e++)
+    {
+      if (e != d && mnt->directory_ptr[e].valid != 0 && !txn_deleting(e) &&
+          !strcmp(mnt->directory_ptr[e].name, mnt->directory_ptr[d].name))
+      {
+        printf("commit: %s would exist twice, delete one of them first\n",
+               mnt->directory_ptr[d].name);
+        return -1;
+      }
+    }
+  }
+
+  if (image_sync() == -1)
+  {
+    printf("commit: Writing %s failed\n", mnt->image_path);
+    return -1;
+  }
+
+  int files = 0;
+
+  for (int d = 0; d < NUM_FILES; d++)
+  {
+    if (mnt->txn_hidden[d] != -1) mnt->directory_ptr[d].hidden = mnt->txn_hidden[d];
+    if (mnt->txn_read_only[d] != -1) mnt->directory_ptr[d].read_only = mnt->txn_read_only[d];
+
+    if (mnt->directory_ptr[d].valid == 1 && txn_deleting(d))
+    {
+      file_delete(d);
+      files++;
+    }
+    else if (mnt->directory_ptr[d].valid == ENTRY_STAGED)
+    {
+      int inode_idx = mnt->directory_ptr[d].inode_idx;
+
+      mnt->directory_ptr[d].valid = 1;
+      mnt->inode_array_ptr[inode_idx]->valid = 1;
+      mark_inode_dirty(inode_idx);
+      list_index_insert(d);
+      files++;
+    }
+  }
+
+  mark_dirty(0);
+  mnt->txn_active = 0;
+
+  if (image_sync() == -1)
+  {
+    printf("commit: Writing %s failed\n", mnt->image_path);
+    return -1;
+  }
+
+  printf("commit: %d files changed\n", files);
+
+  return 0;
+}
+
+//drop the files put inside the transaction and forget the rest
+void txn_abort()
+{
+  for (int d = 0; d < NUM_FILES; d++)
+  {
+    if (mnt->directory_ptr[d].valid != ENTRY_STAGED)
+    {
+      continue;
+    }
+
+    int inode_idx = mnt->directory_ptr[d].inode_idx;
+    int *blocks = mnt->inode_array_ptr[inode_idx]->blocks;
+
+    for (int j = 0; j < MAX_BLOCKS_PER_FILE && blocks[j] != -1; j++)
+    {
+      release_block(blocks[j]);
+      blocks[j] = -1;
+    }
+
+    name_free(mnt->directory_ptr[d].name);
+    mnt->directory_ptr[d].name = NULL;
+    mnt->directory_ptr[d].valid = 0;
+    mnt->inode_array_ptr[inode_idx]->valid = 0;
+    mark_inode_dirty(inode_idx);
+  }
+
+  mark_dirty(0);
+  mnt->txn_active = 0;
+}
+
+void bind_handle (int fd, int dir_idx)
+{
+  mnt->open_files[fd].dir_idx = dir_idx;
+  mnt->open_files[fd].inode_idx = (dir_idx == -1) ? -1 : mnt->directory_ptr[dir_idx].inode_idx;
+  mnt->open_files[fd].inode = (dir_idx == -1) ? NULL : mnt->inode_array_ptr[mnt->open_files[fd].inode_idx];
+}
+
+int main()
+{
+  char * cmd_str = (char*) malloc( MAX_COMMAND_SIZE );
+
+  //the default mount, the one commands use unless they name another
+  mounts[0] = mount_new(NULL);
+  if (mounts[0] == NULL)
+  {
+    perror("mfs: Setting up the file system returned");
+    return 1;
+  }
+
+  pthread_mutex_lock(&fs_lock);
+
+  while( 1 )
+  {
+    // Every branch below ends the command with continue, so the
+    // previous command's latency is accounted here
+    stats_op_end();
+    record_end();
+
+    for (int m = 0; m < MAX_MOUNTS; m++)
+    {
+      if (mounts[m] == NULL)
+      {
+        continue;
+      }
+      mnt = mounts[m];
+
+      // Release deleted files between commands while free space is low,
+      // so del itself never has to walk a block map
+      reclaim_blocks(RECLAIM_LOW_WATER);
+
+      // Freed slices may have left pack blocks mostly empty
+      if (mnt->pack_sparse)
+      {
+        mnt->pack_sparse = 0;
+        pack_compact();
+      }
+
+      if (heat_commands % HEAT_DECAY_COMMANDS == 0)
+      {
+        heat_decay();
+      }
+
+      // Too much unwritten data, wait for writeback before taking more
+      if (mnt->image_fd != -1 && mnt->dirty_count > (NUM_BLOCKS * dirty_ratio) / 100)
+      {
+        image_sync();
+      }
+      else if (mnt->image_fd != -1 && mnt->dirty_count > (NUM_BLOCKS * dirty_background_ratio) / 100)
+      {
+        pthread_cond_signal(&mnt->flush_wake);
+      }
+    }
+
+    // Keep the data blocks read from all the images within the budget
+    cache_trim();
+    mnt = mounts[0];
+    heat_commands++;
+
+    pthread_mutex_unlock(&fs_lock);
+
+    // Print out the mfs prompt
+    printf ("mfs> ");
+
+    // Read the command from the commandline.  The
+    // maximum command that will be read is MAX_COMMAND_SIZE
+    // This while command will wait here until the user
+    // inputs something since fgets returns NULL when there
+    // is no input.  Once the input has ended for good we are done.
+    if( !fgets (cmd_str, MAX_COMMAND_SIZE, stdin) )
+    {
+      pthread_mutex_lock(&fs_lock);
+      break;
+    }
+
+    pthread_mutex_lock(&fs_lock);
+
+    /* Parse input */
+    char *token[MAX_NUM_ARGUMENTS];
+
+    int   token_count = 0;                                 
+                                                           
+    // Pointer to point to the token
+    // parsed by strsep
+    char *arg_ptr;                                         
+                                                           
+    // The line and its tokens live in the scratch arena until the
+    // next command resets it
+    arena_reset(&scratch);
+    char *working_str  = arena_strndup( &scratch, cmd_str, MAX_COMMAND_SIZE );
+
+    // Tokenize the input stringswith whitespace used as the delimiter
+    while ( ( (arg_ptr = strsep(&working_str, WHITESPACE ) ) != NULL) && 
+              (token_count<MAX_NUM_ARGUMENTS))
+    {
+      token[token_count] = arena_strndup( &scratch, arg_ptr, MAX_COMMAND_SIZE );
+      if( strlen( token[token_count] ) == 0 )
+      {
+        token[token_count] = NULL;
+      }
+        token_count++;
+    }
+
+    if ( cmd_str[0] == '\n' || token[0] == NULL ) 
+    {
+      continue;
+    }
+
+    stats_op_begin(token[0]);
+    record_begin(cmd_str, token);
+
+    // alias:name arguments run the command on that mount
+    if (select_mount(token, &token_count) == -1)
+    {
+      printf("%s: The arguments name files on different mounts\n", token[0]);
+      continue;
+    }
+
+    // Commands that replace or check the whole file system wait until
+    // the transaction is over
+    if (mnt->txn_active &&
+        (!strcmp(token[0], "createfs") || !strcmp(token[0], "openfs") ||
+         !strcmp(token[0], "closefs") || !strcmp(token[0], "fsck") ||
+         !strcmp(token[0], "defrag") || !strcmp(token[0], "umount") ||
+         !strcmp(token[0], "begin")))
+    {
+      printf("%s: A transaction is open, commit or abort it first\n", token[0]);
+      continue;
+    }
+
+    // Only put, del and attrib are staged, the commands that rename
+    // files or change their contents wait until the transaction is over
+    if (mnt->txn_active &&
+        (!strcmp(token[0], "mv") || !strcmp(token[0], "cp") ||
+         !strcmp(token[0], "undel") || !strcmp(token[0], "write") ||
+         !strcmp(token[0], "append") || !strcmp(token[0], "truncate") ||
+         !strcmp(token[0], "save") || !strcmp(token[0], "import") ||
+         (!strcmp(token[0], "sync") && token[1] != NULL)))
+    {
+      printf("%s: A transaction is open, commit or abort it first\n", token[0]);
+      continue;
+    }
+
+    if (!strcmp(token[0], "quit"))
+    {
+      record_stop();
+      for (int m = MAX_MOUNTS - 1; m >= 0; m--)
+      {
+        if (mounts[m] != NULL)
+        {
+          mnt = mounts[m];
+          image_close();
+        }
+      }
+      exit(0);
+    }
+
+    /*PUT*/
+    else if(!strcmp(token[0], "put"))
+    {
+      if (token[1] == NULL)
+      {
+        printf("Usage: put <filename> or put - <name>\n");
+        continue;
+      }
+
+      //put - <name> reads stdin up to end of file
+      if (!strcmp(token[1], "-"))
+      {
+        if (token[2] == NULL)
+        {
+          printf("Usage: put - <name>\n");
+          continue;
+        }
+
+        //the rest of the stream is data, never commands, so drop
+        //whatever is left of it if the put failed part way
+        if (put_stream(stdin, token[2]) == -1)
+        {
+          while (fgetc(stdin) != EOF);
+        }
+
+        //let an interactive session carry on after ctrl-d
+        clearerr(stdin);
+        continue;
+      }
+
+      put_file(token[1]);
+    }
+    
+    /*GET*/
+    else if(!strcmp(token[0], "get"))
+    {
+      if (token[1] == NULL)
+      {
+        printf("Usage: get <filename> or get <filename> <newfilename>\n");
+        continue;
+      }
+
+      int status;                   
+      struct stat buf;  
+
+      //Check if a new file name is specified
+      if (token[2] != NULL)
+      {
+        //check the length of the new file name.
+        if (strlen(token[2]) > MAX_FILE_NAME)
+        {
+          printf("Error: New file name too long\n");
+          continue;
+        }
+      }
+      else 
+      {
+        token[2] = token[1]; //Use the old file name
+      }
+
+      int dir_idx = find_file_dir_idx(token[1]);
+
+      if (dir_idx == -1 || mnt->directory_ptr[dir_idx].valid == 0)
+      {
+        printf("get Error: File not found\n");
+        continue;
+      }
+
+      if (direct_io && get_file_direct(mnt->directory_ptr[dir_idx].inode_idx, token[2]) == 0)
+      {
+        continue;
+      }
+
+      //Now, open the output file that we are going to write the data to.
+      FILE *ofp;
+      ofp = fopen(token[2], "w");
+
+      status = stat( token[2], &buf );
+
+      if( ofp == NULL || status == -1)
+      {
+        printf("Could not open output file: %s\n", token[2] );
+        perror("Opening the output file returned");
+        continue;
+      }
+
+      int inode_idx = mnt->directory_ptr[dir_idx].inode_idx;
+
+      int copy_size = mnt->inode_array_ptr[inode_idx]->size;
+
+      int block_entry = 0;
+
+      int offset = 0;
+
+      printf("Writing %d bytes to %s\n", copy_size, token[2] );
+
+      stats_bytes(copy_size);
+
+      while( copy_size > 0 )
+      { 
+        int num_bytes;
+
+        if( copy_size < BLOCK_SIZE )
+        {
+          num_bytes = copy_size;
+        }
+        else 
+        {
+          num_bytes = BLOCK_SIZE;
+        }
+
+        //follow the inode's block list, the blocks are not necessarily contiguous
+        block_read_access(inode_idx, block_entry);
+
+        TRACE_START(trace_start);
+
+        fwrite( file_data(inode_idx, block_entry), num_bytes, 1, ofp ); 
+
+        TRACE_END("get_write", trace_start, "block", mnt->inode_array_ptr[inode_idx]->blocks[block_entry],
+                  "bytes", num_bytes);
+
+        block_entry++;
+
+        copy_size -= BLOCK_SIZE;
+        offset += BLOCK_SIZE;
+
+        fseek( ofp, offset, SEEK_SET );
+      }
+
+      fclose( ofp );
+    }
+
+    /*READ*/
+    else if(!strcmp(token[0], "read"))
+    {
+      //read #<fd> <length> reads at the handle's offset and moves it on
+      if (token[1] != NULL && token[1][0] == '#')
+      {
+        int fd = parse_handle(token[1]);
+
+        if (fd == -1 || mnt->open_files[fd].dir_idx == -1)
+        {
+          printf("read: There is no such open file\n");
+          continue;
+        }
+
+        if (token[2] == NULL || atoi(token[2]) < 0)
+        {
+          printf("Usage: read #<fd> <length>\n");
+          continue;
+        }
+
+        struct open_file *of = &mnt->open_files[fd];
+        int len = atoi(token[2]);
+
+        if (len > of->inode->size)
+        {
+          len = of->inode->size;
+        }
+
+        unsigned char *bytes = malloc(len + 1);
+        int got = file_read(of->inode_idx, of->offset, len, bytes);
+
+        print_hex(of->offset, bytes, got);
+        of->offset += got;
+        free(bytes);
+        continue;
+      }
+
+      if (token[1] == NULL || token[2] == NULL || token[3] == NULL)
+      {
+        printf("Usage: read <filename> <offset> <length>\n");
+        continue;
+      }
+
+      int dir_idx = find_file_dir_idx(token[1]);
+
+      if (dir_idx == -1 || mnt->directory_ptr[dir_idx].valid == 0)
+      {
+        printf("read: File not found\n");
+        continue;
+      }
+
+      int offset = atoi(token[2]);
+      int len = atoi(token[3]);
+
+      if (offset < 0 || len < 0)
+      {
+        printf("read: Offset and length must not be negative\n");
+        continue;
+      }
+
+      int inode_idx = mnt->directory_ptr[dir_idx].inode_idx;
+      int size = mnt->inode_array_ptr[inode_idx]->size;
+
+      if (len > size)
+      {
+        len = size;
+      }
+
+      unsigned char *bytes = malloc(len + 1);
+      int got = file_read(inode_idx, offset, len, bytes);
+
+      print_hex(offset, bytes, got);
+      free(bytes);
+    }
+
+    /*WRITE*/
+    else if(!strcmp(token[0], "write"))
+    {
+      //write #<fd> <hostfile> writes at the handle's offset and moves it on
+      if (token[1] != NULL && token[1][0] == '#')
+      {
+        int fd = parse_handle(token[1]);
+
+        if (fd == -1 || mnt->open_files[fd].dir_idx == -1)
+        {
+          printf("write: There is no such open file\n");
+          continue;
+        }
+
+        if (token[2] == NULL)
+        {
+          printf("Usage: write #<fd> <hostfile>\n");
+          continue;
+        }
+
+        struct open_file *of = &mnt->open_files[fd];
+
+        if (mnt->directory_ptr[of->dir_idx].read_only == 1)
+        {
+          printf("write: Cannot write file because it is read-only\n");
+          continue;
+        }
+
+        struct stat buf;
+
+        if (stat(token[2], &buf) == 0 && write_host_file(of->dir_idx, of->offset, token[2]) == 0)
+        {
+          of->offset += buf.st_size;
+        }
+        continue;
+      }
+
+      if (token[1] == NULL || token[2] == NULL || token[3] == NULL)
+      {
+        printf("Usage: write <filename> <offset> <hostfile>\n");
+        continue;
+      }
+
+      int dir_idx = find_file_dir_idx(token[1]);
+
+      if (dir_idx == -1 || mnt->directory_ptr[dir_idx].valid == 0)
+      {
+        printf("write: File not found\n");
+        continue;
+      }
+
+      if (mnt->directory_ptr[dir_idx].read_only == 1)
+      {
+        printf("write: Cannot write file because it is read-only\n");
+        continue;
+      }
+
+      int offset = atoi(token[2]);
+
+      if (offset < 0)
+      {
+        printf("write: Offset must not be negative\n");
+        continue;
+      }
+
+      write_host_file(dir_idx, offset, token[3]);
+    }
+
+    /*APPEND*/
+    else if(!strcmp(token[0], "append"))
+    {
+      if (token[1] == NULL || token[2] == NULL)
+      {
+        printf("Usage: append <filename> <hostfile>\n");
+        continue;
+      }
+
+      int dir_idx = find_file_dir_idx(token[1]);
+
+      if (dir_idx == -1 || mnt->directory_ptr[dir_idx].valid == 0)
+      {
+        printf("append: File not found\n");
+        continue;
+      }
+
+      if (mnt->directory_ptr[dir_idx].read_only == 1)
+      {
+        printf("append: Cannot write file because it is read-only\n");
+        continue;
+      }
+
+      int inode_idx = mnt->directory_ptr[dir_idx].inode_idx;
+
+      write_host_file(dir_idx, mnt->inode_array_ptr[inode_idx]->size, token[2]);
+    }
+
+    /*TRUNCATE*/
+    else if(!strcmp(token[0], "truncate"))
+    {
+      if (token[1] == NULL || token[2] == NULL)
+      {
+        printf("Usage: truncate <filename> <size>\n");
+        continue;
+      }
+
+      int dir_idx = find_file_dir_idx(token[1]);
+
+      if (dir_idx == -1 || mnt->directory_ptr[dir_idx].valid == 0)
+      {
+        printf("truncate: File not found\n");
+        continue;
+      }
+
+      if (mnt->directory_ptr[dir_idx].read_only == 1)
+      {
+        printf("truncate: Cannot change file because it is read-only\n");
+        continue;
+      }
+
+      if (file_resize(mnt->directory_ptr[dir_idx].inode_idx, atoi(token[2])) == -1)
+      {
+        printf("truncate error: Not enough disk space or file too large\n");
+        continue;
+      }
+
+      list_index_update(dir_idx);
+    }
+
+    /*CP*/
+    else if(!strcmp(token[0], "cp"))
+    {
+      if (token[1] == NULL || token[2] == NULL)
+      {
+        printf("Usage: cp <source> <destination>\n");
+        continue;
+      }
+
+      int src_idx = find_file_dir_idx(token[1]);
+
+      if (src_idx == -1)
+      {
+        printf("cp Error: File not found\n");
+        continue;
+      }
+
+      if (find_file_dir_idx(token[2]) != -1)
+      {
+        printf("cp: %s already exists\n", token[2]);
+        continue;
+      }
+
+      copy_file(src_idx, token[2]);
+    }
+
+    /*MV*/
+    else if(!strcmp(token[0], "mv"))
+    {
+      if (token[1] == NULL || token[2] == NULL)
+      {
+        printf("Usage: mv <old name> <new name>\n");
+        continue;
+      }
+
+      int src_idx = find_file_dir_idx(token[1]);
+
+      if (src_idx == -1)
+      {
+        printf("mv Error: File not found\n");
+        continue;
+      }
+
+      if (strlen(token[2]) > MAX_FILE_NAME)
+      {
+        printf("mv: File name too long\n");
+        continue;
+      }
+
+      //the file being replaced is deleted, so the same rules apply
+      int dst_idx = find_file_dir_idx(token[2]);
+
+      if (dst_idx != -1 && dst_idx != src_idx)
+      {
+        if (mnt->directory_ptr[dst_idx].read_only == 1)
+        {
+          printf("mv: Cannot replace %s because it is read-only\n", token[2]);
+          continue;
         }
-        else 
+
+        if (file_is_open(dst_idx))
         {
-          num_bytes = BLOCK_SIZE;
+          printf("mv: Cannot replace %s because it is open\n", token[2]);
+          continue;
+        }
+      }
+
+      rename_file(src_idx, token[2]);
+    }
+
+    /*DEL*/
+    else if(!strcmp(token[0], "del"))
+    {
+      if (token[1] == NULL)
+      {
+        printf("Usage: del <filename>\n");
+        continue;
+      }
+
+      int dir_idx = find_file_dir_idx(token[1]);
+
+      if (dir_idx == -1 || mnt->directory_ptr[dir_idx].valid == 0 || txn_deleting(dir_idx))
+      {
+        printf("del Error: File not found\n");
+        continue;
+      }
+
+      //check if the file is read-only
+      if (mnt->directory_ptr[dir_idx].read_only == 1)
+      {
+        printf("del: Cannot delete file because it is read-only\n");
+        continue;
+      }
+
+      if (file_is_open(dir_idx))
+      {
+        printf("del: Cannot delete file because it is open\n");
+        continue;
+      }
+
+      //inside a transaction the file goes at commit
+      if (mnt->txn_active)
+      {
+        mnt->txn_del[mnt->directory_ptr[dir_idx].inode_idx] = 1;
+        continue;
+      }
+
+      file_delete(dir_idx);
+    }
+
+    /*UNDEL*/
+    else if(!strcmp(token[0], "undel"))
+    {
+      if (token[1] == NULL)
+      {
+        printf("Usage: undel <filename>\n");
+        continue;
+      }
+
+      if (find_file_dir_idx(token[1]) != -1)
+      {
+        printf("The file you are trying to undelete has not been deleted\n");
+        continue;
+      }
+
+      int inode_idx = find_tombstone(token[1]);
+
+      if (inode_idx == -1)
+      {
+        printf("undel: Can not find the file\n");
+        continue;
+      }
+
+      int dir_idx = findFreeDirectoryEntry();
+
+      if (dir_idx == -1)
+      {
+        printf("undel: No free directory entries\n");
+        continue;
+      }
+
+      mnt->directory_ptr[dir_idx].name = mnt->tombstones[inode_idx].name;
+      mnt->directory_ptr[dir_idx].hidden = mnt->tombstones[inode_idx].hidden;
+      mnt->directory_ptr[dir_idx].read_only = mnt->tombstones[inode_idx].read_only;
+      mnt->directory_ptr[dir_idx].inode_idx = inode_idx;
+      mnt->directory_ptr[dir_idx].valid = 1;
+
+      mnt->reclaimable_blocks -= inode_block_count(inode_idx);
+      tombstone_unlink(inode_idx);
+
+      mnt->inode_array_ptr[inode_idx]->valid = 1;
+
+      mark_dirty(0);
+      mark_inode_dirty(inode_idx);
+
+      list_index_insert(dir_idx);
+    }
+
+    /*LIST*/
+    else if(!strcmp(token[0], "list"))
+    {
+      int key = LIST_SORT_DATE;
+      int reverse = 0;
+      int page = 0;
+      int page_size = LIST_DEFAULT_PAGE;
+      char *pattern = NULL;
+      int bad_usage = 0;
+
+      //list [-s name|size|date] [-r] [-p <page>] [-n <per page>] [pattern]
+      for (int i = 1; i < token_count && token[i] != NULL; i++)
+      {
+        if (!strcmp(token[i], "-s") && i + 1 < token_count && token[i + 1] != NULL)
+        {
+          i++;
+          if (!strcmp(token[i], "name"))      key = LIST_SORT_NAME;
+          else if (!strcmp(token[i], "size")) key = LIST_SORT_SIZE;
+          else if (!strcmp(token[i], "date")) key = LIST_SORT_DATE;
+          else bad_usage = 1;
+        }
+        else if (!strcmp(token[i], "-r"))
+        {
+          reverse = 1;
+        }
+        else if (!strcmp(token[i], "-p") && i + 1 < token_count && token[i + 1] != NULL)
+        {
+          page = atoi(token[++i]);
+          if (page < 1) bad_usage = 1;
+        }
+        else if (!strcmp(token[i], "-n") && i + 1 < token_count && token[i + 1] != NULL)
+        {
+          page_size = atoi(token[++i]);
+          if (page_size < 1) bad_usage = 1;
+          if (page == 0) page = 1;
+        }
+        else if (token[i][0] != '-' && pattern == NULL)
+        {
+          pattern = token[i];
+        }
+        else
+        {
+          bad_usage = 1;
+        }
+      }
+
+      if (bad_usage)
+      {
+        printf("Usage: list [-s name|size|date] [-r] [-p <page>] [-n <per page>] [pattern]\n");
+        continue;
+      }
+
+      list_files(key, reverse, pattern, page, page_size);
+    }
+
+    /*DEFRAG*/
+    else if(!strcmp(token[0], "defrag"))
+    {
+      //defrag [max files]: without a limit the whole directory is done,
+      //with one the pass stops early and the next defrag continues from there
+      int max_files = NUM_FILES;
+
+      if (token[1] != NULL)
+      {
+        max_files = atoi(token[1]);
+        if (max_files < 1)
+        {
+          printf("Usage: defrag [max files]\n");
+          continue;
+        }
+      }
+
+      int files_moved = 0;
+      int blocks_moved = 0;
+      int skipped = 0;
+
+      for (int n = 0; n < NUM_FILES && files_moved < max_files; n++)
+      {
+        int d = mnt->defrag_cursor;
+        mnt->defrag_cursor = (mnt->defrag_cursor + 1) % NUM_FILES;
+
+        if (mnt->directory_ptr[d].valid == 0)
+        {
+          continue;
+        }
+
+        int inode_idx = mnt->directory_ptr[d].inode_idx;
+        int moved = defrag_file(inode_idx);
+
+        if (moved > 0)
+        {
+          files_moved++;
+          blocks_moved += moved;
+        }
+        else if (count_file_extents(inode_idx) > 1)
+        {
+          skipped++;
+        }
+      }
+
+      printf("defrag: moved %d blocks in %d files", blocks_moved, files_moved);
+      if (skipped > 0)
+      {
+        printf(", %d files left fragmented (shared, or no free run large enough)", skipped);
+      }
+      printf("\n");
+    }
+
+    /*FRAG*/
+    else if(!strcmp(token[0], "frag"))
+    {
+      frag_report();
+    }
+
+    /*STATS*/
+    else if(!strcmp(token[0], "stats"))
+    {
+      //stats, stats reset, stats prom <file> [seconds], stats prom off
+      if (token[1] == NULL)
+      {
+        stats_print();
+      }
+      else if (!strcmp(token[1], "reset"))
+      {
+        memset(op_stats, 0, sizeof(op_stats));
+        memset(scan_stats, 0, sizeof(scan_stats));
+      }
+      else if (!strcmp(token[1], "prom") && token[2] != NULL && !strcmp(token[2], "off"))
+      {
+        stats_prom_stop();
+      }
+      else if (!strcmp(token[1], "prom") && token[2] != NULL)
+      {
+        int interval = (token[3] != NULL) ? atoi(token[3]) : 0;
+
+        if (interval <= 0)
+        {
+          //one shot dump
+          if (stats_dump_prom(token[2]) == -1)
+          {
+            perror("stats: prometheus dump");
+          }
+        }
+        else if (stats_prom_start(token[2], interval) == -1)
+        {
+          printf("stats: Could not start the dump thread\n");
+        }
+      }
+      else
+      {
+        printf("Usage: stats [reset | prom <file> [seconds] | prom off]\n");
+      }
+    }
+
+    /*TRACE*/
+    else if(!strcmp(token[0], "trace"))
+    {
+#ifdef MFS_TRACE
+      if (token[1] != NULL && !strcmp(token[1], "dump") && token[2] != NULL)
+      {
+        int events = trace_dump(token[2]);
+
+        if (events == -1)
+        {
+          perror("trace: dump");
+        }
+        else
+        {
+          printf("trace: wrote %d events to %s\n", events, token[2]);
+        }
+      }
+      else if (token[1] != NULL && !strcmp(token[1], "clear"))
+      {
+        trace_clear();
+      }
+      else
+      {
+        printf("Usage: trace dump <file> | trace clear\n");
+      }
+#else
+      printf("trace: Tracepoints are not compiled in, build with -DMFS_TRACE\n");
+#endif
+    }
+
+    /*FSCK*/
+    else if(!strcmp(token[0], "fsck"))
+    {
+      //fsck checks, fsck -y also repairs
+      int repair = 0;
+
+      if (token[1] != NULL && !strcmp(token[1], "-y"))
+      {
+        repair = 1;
+      }
+      else if (token[1] != NULL)
+      {
+        printf("Usage: fsck [-y]\n");
+        continue;
+      }
+
+      int open_count = 0;
+      for (int fd = 0; fd < MAX_OPEN_FILES; fd++)
+      {
+        if (mnt->open_files[fd].name != NULL) open_count++;
+      }
+
+      //repairs can drop or rename directory entries under a handle
+      if (repair && open_count > 0)
+      {
+        printf("fsck: Close all open files before repairing\n");
+        continue;
+      }
+
+      fsck(repair);
+    }
+
+    /*EXPORT and IMPORT*/
+    else if(!strcmp(token[0], "export") || !strcmp(token[0], "import"))
+    {
+      if (token[1] == NULL)
+      {
+        printf("Usage: %s <archive>\n", token[0]);
+        continue;
+      }
+
+      if (!strcmp(token[0], "export"))
+      {
+        int files = export_image(token[1]);
+
+        if (files != -1)
+        {
+          printf("export: Wrote %d files to %s\n", files, token[1]);
+        }
+      }
+      else
+      {
+        int files = import_image(token[1]);
+
+        if (files != -1)
+        {
+          printf("import: Added %d files from %s\n", files, token[1]);
         }
+      }
+    }
+
+    /*RECORD*/
+    else if(!strcmp(token[0], "record"))
+    {
+      //record <file> logs the commands that follow, record off stops
+      if (token[1] == NULL)
+      {
+        printf("record is %s\n", (record_fp != NULL) ? "on" : "off");
+      }
+      else if (!strcmp(token[1], "off"))
+      {
+        //not part of the recording itself
+        record_cmd_len = -1;
+        record_stop();
+      }
+      else if (record_start(token[1]) == -1)
+      {
+        perror("record: Opening the recording returned");
+      }
+    }
+
+    /*DF*/
+    else if(!strcmp(token[0], "df"))
+    {
+      printf("%d bytes free\n", df());
+      printf("%d bytes reclaimable\n", df_reclaimable());
+    }
+
+    /*OPEN*/
+    else if(!strcmp(token[0], "open"))
+    {
+      if (token[1] == NULL)
+      {
+        printf("Usage: open <filename>\n");
+        continue;
+      }
+
+      //check the length of the file name.
+      if (strlen(token[1]) > MAX_FILE_NAME)
+      {
+        printf("open: File name too long\n");
+        continue;
+      }
+
+      int dir_idx = find_file_dir_idx(token[1]);
 
-        int bytes  = fread( data_blocks[block_index], num_bytes, 1, ifp );
+      //a file that is not in the file system yet can still be opened
+      //from the host so save can import it
+      if (dir_idx == -1)
+      {
+        struct stat buf;
 
-        // If bytes == 0 and we haven't reached the end of the file then something is 
-        // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-        // It means we've reached the end of our input file.
-        if( bytes == 0 && !feof( ifp ) )
+        if (stat( token[1], &buf ) == -1)
         {
-          printf("An error occured reading from the input file.\n");
-          return -1;
+          printf("open: File not found\n");
+          continue;
         }
+      }
 
-        clearerr( ifp );
+      int fd = 0;
+      while (fd < MAX_OPEN_FILES && mnt->open_files[fd].name != NULL)
+      {
+        fd++;
+      }
 
-        copy_size -= BLOCK_SIZE;
-        offset += BLOCK_SIZE;
+      if (fd == MAX_OPEN_FILES)
+      {
+        printf("open: Too many open files\n");
+        continue;
       }
 
-      fclose( ifp );
+      mnt->open_files[fd].name = name_dup(token[1]);
+      mnt->open_files[fd].offset = 0;
+      bind_handle(fd, dir_idx);
+
+      printf("open: %s is #%d\n", token[1], fd);
     }
-    
-    /*GET*/
-    else if(!strcmp(token[0], "get"))
+
+    /*SAVE*/
+    else if(!strcmp(token[0], "save"))
     {
-      if (token[1] == NULL)
+      int fd = (token[1] != NULL) ? parse_handle(token[1]) : single_open_handle();
+
+      //check if a file is open
+      if (fd == -1)
       {
-        printf("Usage: get <filename> or get <filename> <newfilename>\n");
+        printf("save: There is no such open file\n");
         continue;
       }
 
-      int status;                   
-      struct stat buf;  
+      struct open_file *of = &mnt->open_files[fd];
 
-      //Check if a new file name is specified
-      if (token[2] != NULL)
+      //import the host file the first time, after that replace the
+      //contents of the file it was imported as
+      if (of->dir_idx == -1)
       {
-        //check the length of the new file name.
-        if (strlen(token[2]) > MAX_FILE_NAME)
+        if (put_file(of->name) == 0)
         {
-          printf("Error: New file name too long\n");
-          continue;
+          bind_handle(fd, find_file_dir_idx(of->name));
         }
+        continue;
       }
-      else 
+
+      if (mnt->directory_ptr[of->dir_idx].read_only == 1)
       {
-        token[2] = token[1]; //Use the old file name
+        printf("save: Cannot write file because it is read-only\n");
+        continue;
       }
 
-      int dir_idx = find_file_dir_idx(token[1]);
+      struct stat buf;
 
-      if (dir_idx == -1 || directory_ptr[dir_idx].valid == 0)
+      if (stat( of->name, &buf ) == -1)
       {
-        printf("get Error: File not found\n");
+        printf("Unable to open file: %s\n", of->name );
+        perror("Opening the input file returned");
         continue;
       }
 
-      //Now, open the output file that we are going to write the data to.
-      FILE *ofp;
-      ofp = fopen(token[2], "w");
+      if (buf.st_size < of->inode->size && file_resize(of->inode_idx, buf.st_size) == -1)
+      {
+        printf("save error: Not enough disk space to shrink %s\n", of->name);
+        continue;
+      }
 
-      status = stat( token[2], &buf );
+      if (write_host_file(of->dir_idx, 0, of->name) == 0)
+      {
+        printf("Saved %d bytes from %s\n", of->inode->size, of->name);
+      }
+    }
 
-      if( ofp == NULL || status == -1)
+    /*SEEK*/
+    else if(!strcmp(token[0], "seek"))
+    {
+      int fd = parse_handle(token[1]);
+
+      if (fd == -1 || token[2] == NULL || atoi(token[2]) < 0)
       {
-        printf("Could not open output file: %s\n", token[2] );
-        perror("Opening the output file returned");
+        printf("Usage: seek #<fd> <offset>\n");
         continue;
       }
 
-      int inode_idx = directory_ptr[dir_idx].inode_idx;
+      mnt->open_files[fd].offset = atoi(token[2]);
+    }
+
+    /*CLOSE*/
+    else if(!strcmp(token[0], "close"))
+    {
+      int fd = (token[1] != NULL) ? parse_handle(token[1]) : single_open_handle();
 
-      int copy_size = inode_array_ptr[inode_idx]->size;
+      //check if the file is open
+      if (fd == -1)
+      {
+        printf("close: There is no such open file\n");
+        continue;
+      }
 
-      int block_index = find_first_block_index(inode_idx);
+      //free the name, which also marks the handle free
+      name_free(mnt->open_files[fd].name);
+      mnt->open_files[fd].name = NULL;
+    }
 
-      int offset = 0;
+    /*ATTRIB*/
+    else if(!strcmp(token[0], "attrib"))
+    {
+      if (token[1] == NULL || token[2] == NULL)
+      {
+        printf("Usage: attrib +/-<attribute> <filename>\n");
+        continue;
+      }
 
-      printf("Writing %d bytes to %s\n", copy_size, token[2] );
+      int dir_idx = find_file_dir_idx(token[2]);
 
-      while( copy_size > 0 )
-      { 
-        int num_bytes;
+      if (dir_idx == -1 || mnt->directory_ptr[dir_idx].valid == 0)
+      {
+        printf("attrib: File not found\n");
+        continue;
+      }
 
-        if( copy_size < BLOCK_SIZE )
+      //inside a transaction the change is applied at commit
+      if (mnt->txn_active)
+      {
+        if (!strcmp(token[1], "+h") || !strcmp(token[1], "-h"))
         {
-          num_bytes = copy_size;
+          mnt->txn_hidden[dir_idx] = (token[1][0] == '+');
         }
-        else 
+        else if (!strcmp(token[1], "+r") || !strcmp(token[1], "-r"))
         {
-          num_bytes = BLOCK_SIZE;
+          mnt->txn_read_only[dir_idx] = (token[1][0] == '+');
         }
+        continue;
+      }
+
+      if (!strcmp(token[1], "+h") && mnt->directory_ptr[dir_idx].hidden == 0)
+      {
+        mnt->directory_ptr[dir_idx].hidden = 1;
+      }
+      else if (!strcmp(token[1], "-h") && mnt->directory_ptr[dir_idx].hidden == 1)
+      {
+        mnt->directory_ptr[dir_idx].hidden = 0;
+      }
+      else if (!strcmp(token[1], "+r") && mnt->directory_ptr[dir_idx].read_only == 0)
+      {
+        mnt->directory_ptr[dir_idx].read_only = 1;
+      }
+      else if (!strcmp(token[1], "-r") && mnt->directory_ptr[dir_idx].read_only == 1)
+      {
+        mnt->directory_ptr[dir_idx].read_only = 0;
+      }
 
-        fwrite( data_blocks[block_index], num_bytes, 1, ofp ); 
+      mark_dirty(0);
+    }
 
-        copy_size -= BLOCK_SIZE;
-        offset += BLOCK_SIZE;
-        block_index++;
+    /*CREATEFS*/
+    else if(!strcmp(token[0], "createfs"))
+    {
+      //createfs <image> [-u <blocks>] [<member> ...] stripes the image
+      //over itself and the members
+      char *members[MAX_STRIPES];
+      int count = 1;
+      int unit = STRIPE_DEFAULT_UNIT;
+      int usage = (token[1] == NULL);
+
+      for (int i = 2; i < token_count && token[i] != NULL && !usage; i++)
+      {
+        if (!strcmp(token[i], "-u"))
+        {
+          unit = (i + 1 < token_count && token[i + 1] != NULL) ? atoi(token[++i]) : 0;
+          usage = (unit <= 0);
+        }
+        else if (count < MAX_STRIPES)
+        {
+          members[count++ - 1] = token[i];
+        }
+        else
+        {
+          usage = 1;
+        }
+      }
 
-        fseek( ofp, offset, SEEK_SET );
+      if (usage)
+      {
+        printf("Usage: createfs <image> [-u <blocks per stripe unit>] [<member> ...],"
+               " at most %d members\n", MAX_STRIPES - 1);
+        continue;
       }
 
-      fclose( ofp );
+      if (image_create(token[1], unit, members, count) == -1)
+      {
+        printf("createfs: Could not create %s\n", token[1]);
+      }
     }
 
-    /*DEL*/
-    else if(!strcmp(token[0], "del"))
+    /*OPENFS*/
+    else if(!strcmp(token[0], "openfs"))
     {
       if (token[1] == NULL)
       {
-        printf("Usage: del <filename>\n");
+        printf("Usage: openfs <image>\n");
         continue;
       }
 
-      int dir_idx = find_file_dir_idx(token[1]);
+      image_open(token[1]);
+    }
 
-      if (dir_idx == -1 || directory_ptr[dir_idx].valid == 0)
+    /*SAVEFS and SYNC*/
+    else if(!strcmp(token[0], "savefs") || !strcmp(token[0], "sync"))
+    {
+      //sync <file> updates one stored file from the host instead
+      if (!strcmp(token[0], "sync") && token[1] != NULL)
       {
-        printf("del Error: File not found\n");
+        sync_file(token[1]);
         continue;
       }
 
-      //check if the file is read-only
-      if (directory_ptr[dir_idx].read_only == 1)
+      if (mnt->image_fd == -1)
       {
-        printf("del: Cannot delete file because it is read-only\n");
+        printf("%s: There is no open image, use createfs or openfs\n", token[0]);
         continue;
       }
 
-      int inode_idx = directory_ptr[dir_idx].inode_idx;
-
-      directory_ptr[dir_idx].valid = 0;
-      inode_array_ptr[inode_idx]->valid = 0;
-
-      //Before setting every block entries to -1,
-      //get the first block index where the file starts.
-      //Then, after setting the block values on the block array to -1,
-      //store the block index that we just got in the first entry of block array
-      //so we can undelete it after we delete.
-      //the file will be permanently deleted when the inode is used again for a new file
-      //since we did set the inode.valid to 0, and won't be able to
-      //find the name of the file on this inode
-      int undel_block_idx;
-
-      for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+      if (image_sync() == -1)
       {
-        undel_block_idx = inode_array_ptr[inode_idx]->blocks[i];
-        break;
+        printf("%s: Writing %s failed\n", token[0], mnt->image_path);
       }
+    }
 
-      for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++)
+    /*CLOSEFS*/
+    else if(!strcmp(token[0], "closefs"))
+    {
+      if (mnt->image_fd == -1)
       {
-        inode_array_ptr[inode_idx]->blocks[i] = -1;
+        printf("closefs: There is no open image\n");
+        continue;
       }
 
-      inode_array_ptr[inode_idx]->blocks[0] = undel_block_idx;
+      image_close();
+      fs_reset();
+      init();
     }
 
-    /*UNDEL*/
-    else if(!strcmp(token[0], "undel"))
+    /*DIRECTIO*/
+    else if(!strcmp(token[0], "directio"))
     {
       if (token[1] == NULL)
       {
-        printf("Usage: undel <filename>\n");
+        printf("directio is %s\n", direct_io ? "on" : "off");
         continue;
       }
 
-      int dir_idx = find_file_dir_idx(token[1]);
-
-      if (dir_idx == -1)
+      if (!strcmp(token[1], "on"))
       {
-        printf("undel: Can not find the file\n");
-        continue;
+        direct_io = 1;
       }
-
-      if (directory_ptr[dir_idx].valid == 1)
+      else if (!strcmp(token[1], "off"))
       {
-        printf("The file you are trying to undelete has not been deleted\n");
+        direct_io = 0;
       }
-
-      directory_ptr[dir_idx].valid = 1;
-
-      int inode_idx = directory_ptr[dir_idx].inode_idx;
-
-      inode_array_ptr[inode_idx]->valid = 1;
-
-      int block_index = inode_array_ptr[inode_idx]->blocks[0];
-
-      int size = inode_array_ptr[inode_idx]->size;
-
-      //similar to copying, but here we are just setting the 
-      //block array values back
-      int i = 0;
-      while (size > 0)
+      else
       {
-        inode_array_ptr[inode_idx]->blocks[i] = block_index;
-
-        size -= BLOCK_SIZE;
-        i++;
-        block_index++;
+        printf("Usage: directio [on | off]\n");
+        continue;
       }
+
+      image_set_direct(direct_io);
     }
 
-    /*LIST*/
-    else if(!strcmp(token[0], "list"))
+    /*BEGIN, COMMIT and ABORT*/
+    else if(!strcmp(token[0], "begin"))
     {
-      int found = 0;
+      txn_begin();
+    }
 
-      for (int i = 0; i < NUM_FILES; i++)
+    else if(!strcmp(token[0], "commit") || !strcmp(token[0], "abort"))
+    {
+      if (!mnt->txn_active)
       {
-        if (directory_ptr[i].valid == 1 && directory_ptr[i].hidden == 0)
-        {
-          int inode_idx = directory_ptr[i].inode_idx;
-          int size = inode_array_ptr[inode_idx]->size;
-          char *name = directory_ptr[i].name;
-          time_t time_added = inode_array_ptr[inode_idx]->date;
-          char *time = strtok(ctime(&time_added), "\n");
-
-          printf("%5d  %5s  %5s\n", size, time, name);
-
-          found = 1;
-        }
+        printf("%s: There is no open transaction\n", token[0]);
+        continue;
       }
 
-      if (found == 0)
+      if (!strcmp(token[0], "commit"))
       {
-        printf("list: No files found\n");
+        txn_commit();
+      }
+      else
+      {
+        txn_abort();
       }
     }
 
-    /*DF*/
-    else if(!strcmp(token[0], "df"))
+    /*HEAT*/
+    else if(!strcmp(token[0], "heat"))
     {
-      printf("%d bytes free\n", df());
+      heat_print(token[1]);
     }
 
-    /*OPEN*/
-    else if(!strcmp(token[0], "open"))
+    /*MOUNT*/
+    else if(!strcmp(token[0], "mount"))
     {
       if (token[1] == NULL)
       {
-        printf("Usage: open <filename>\n");
+        for (int m = 0; m < MAX_MOUNTS; m++)
+        {
+          if (mounts[m] != NULL)
+          {
+            printf("%-12s %s\n", m == 0 ? "(default)" : mounts[m]->alias,
+                   mounts[m]->image_fd != -1 ? mounts[m]->image_path : "(in memory)");
+          }
+        }
         continue;
       }
 
-      int status;                   // Hold the status of all return values.
-      struct stat buf;              // stat struct to hold the returns from the stat call
-
-      status = stat( token[1], &buf ); 
-      
-      //Verify that the file exists
-      if (status == -1)
+      if (token[2] == NULL || strchr(token[2], ':') != NULL)
       {
-        printf("open: File not found\n");
+        printf("Usage: mount <image> <alias>, the alias may not contain ':'\n");
         continue;
       }
 
-      //check the length of the file name.
-      if (strlen(token[1]) > MAX_FILE_NAME)
+      if (find_mount(token[2]) != NULL)
       {
-        printf("put error: File name too long\n");
+        printf("mount: %s is already mounted\n", token[2]);
         continue;
       }
 
-      //store file name while it is open
-      open_file = (char *)malloc(strlen(token[1]));
-      strncpy(open_file, token[1], strlen(token[1]));
-    }
-
-    /*SAVE*/
-    else if(!strcmp(token[0], "save"))
-    {
-      //check if a file is open
-      if (open_file == NULL)
+      int slot = 1;
+      while (slot < MAX_MOUNTS && mounts[slot] != NULL)
       {
-        printf("save: There is no open file\n");
-        continue;
+        slot++;
       }
 
-      /*Execute put using the open file's name*/
-
-      int status;                   
-      struct stat buf;              
-
-      status = stat( open_file, &buf ); 
-      
-      //Verify that the file exists
-      if (status == -1)
+      if (slot == MAX_MOUNTS)
       {
-        printf("Unable to open file: %s\n", open_file );
-        perror("Opening the input file returned");
+        printf("mount: No more than %d images can be mounted\n", MAX_MOUNTS);
         continue;
       }
 
-      //check the length of the file name.
-      if (strlen(open_file) > MAX_FILE_NAME)
+      if (mount_new(token[2]) == NULL)
       {
-        printf("put error: File name too long\n");
+        printf("mount: Not enough memory for %s\n", token[2]);
         continue;
       }
 
-      //Check if there is enough space
-      if (buf.st_size > df())
+      if (image_open(token[1]) == -1)
       {
-        printf("put error: Not enough disk space\n");
+        mount_free();
         continue;
       }
 
-      int dir_idx = findFreeDirectoryEntry();
+      mounts[slot] = mnt;
+    }
 
-      if (dir_idx == -1)
+    /*UMOUNT*/
+    else if(!strcmp(token[0], "umount"))
+    {
+      if (token[1] == NULL)
       {
-        printf("Error: Not enough disk space\n");
+        printf("Usage: umount <alias>\n");
         continue;
       }
 
-      directory_ptr[dir_idx].valid = 1; //used
-
-      directory_ptr[dir_idx].name = (char *)malloc(strlen(open_file)); 
-      strncpy(directory_ptr[dir_idx].name, open_file, strlen(open_file)); //Copy file name
-
-      int inode_idx = findFreeInode();
+      int slot = 1;
+      while (slot < MAX_MOUNTS && (mounts[slot] == NULL || strcmp(mounts[slot]->alias, token[1])))
+      {
+        slot++;
+      }
 
-      if (inode_idx == -1)
+      if (slot == MAX_MOUNTS)
       {
-        printf("Error: No free inodes\n");
+        printf("umount: %s is not mounted\n", token[1]);
         continue;
       }
 
-      directory_ptr[dir_idx].inode_idx = inode_idx;
-      
-      inode_array_ptr[inode_idx]->valid = 1;
-      inode_array_ptr[inode_idx]->size = buf.st_size;
-      inode_array_ptr[inode_idx]->date = time(NULL); 
-
-      // Open the input file read-only 
-      FILE *ifp = fopen ( open_file, "r" ); 
-      printf("Reading %d bytes from %s\n", (int) buf . st_size, open_file );
+      mnt = mounts[slot];
 
-      int copy_size = buf.st_size;
-      int offset = 0;               
-  
-      // copy_size is initialized to the size of the input file so each loop iteration we
-      // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-      // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-      // we have copied all the data from the input file.
-      while( copy_size > 0 )
+      int open_count = 0;
+      for (int fd = 0; fd < MAX_OPEN_FILES; fd++)
       {
-        int block_index = findFreeBlock();
-
-        if (block_index == -1)
-        {
-          printf("Error: No free blocks\n");
-          break;
-        }
-
-        used_blocks[block_index] = 1;
-
-        int inode_block_entry = findFreeInodeBlockEntry(inode_idx);
-        if (inode_block_entry == -1)
-        {
-          printf("Error: No free node blocks\n");
-          break;
-        }
-
-        inode_array_ptr[inode_idx]->blocks[inode_block_entry] = block_index;
-
-        // Index into the input file by offset number of bytes.  Initially offset is set to
-        // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-        // then increase the offset by BLOCK_SIZE and continue the process.  This will
-        // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-        fseek( ifp, offset, SEEK_SET );
-
-        int num_bytes;
-
-        // If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-        // only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
-        // end up with garbage at the end of the file.
-        if( copy_size < BLOCK_SIZE )
-        {
-          num_bytes = copy_size;
-        }
-        else 
-        {
-          num_bytes = BLOCK_SIZE;
-        }
-
-        int bytes  = fread( data_blocks[block_index], num_bytes, 1, ifp );
-
-        // If bytes == 0 and we haven't reached the end of the file then something is 
-        // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-        // It means we've reached the end of our input file.
-        if( bytes == 0 && !feof( ifp ) )
-        {
-          printf("An error occured reading from the input file.\n");
-          return -1;
-        }
-
-        clearerr( ifp );
-
-        copy_size -= BLOCK_SIZE;
-        offset += BLOCK_SIZE;
+        if (mnt->open_files[fd].name != NULL) open_count++;
       }
 
-      fclose( ifp );
-
-    }
-
-    /*CLOSE*/
-    else if(!strcmp(token[0], "close"))
-    {
-      //check if any file is open
-      if (open_file == NULL)
+      if (open_count > 0)
       {
-        printf("close: There is no open file\n");
+        printf("umount: Close the open files on %s first\n", token[1]);
         continue;
       }
 
-      //free and set open_file to NULL
-      free(open_file);
-      open_file = NULL;
+      mount_free();
+      mounts[slot] = NULL;
     }
 
-    /*ATTRIB*/
-    else if(!strcmp(token[0], "attrib"))
+    /*TUNE*/
+    else if(!strcmp(token[0], "tune"))
     {
-      if (token[1] == NULL || token[2] == NULL)
+      //tune [dirty_ratio | dirty_background_ratio | dirty_expire_secs <value>]
+      if (token[1] == NULL)
       {
-        printf("Usage: attrib +/-<attribute> <filename>\n");
+        printf("dirty_ratio %d\ndirty_background_ratio %d\ndirty_expire_secs %d\n",
+               dirty_ratio, dirty_background_ratio, dirty_expire_secs);
         continue;
       }
 
-      int dir_idx = find_file_dir_idx(token[2]);
+      int value = (token[2] != NULL) ? atoi(token[2]) : -1;
 
-      if (dir_idx == -1 || directory_ptr[dir_idx].valid == 0)
+      if (!strcmp(token[1], "dirty_ratio") && value >= 0 && value <= 100)
       {
-        printf("attrib: File not found\n");
-        continue;
+        dirty_ratio = value;
       }
-
-      if (!strcmp(token[1], "+h") && directory_ptr[dir_idx].hidden == 0)
+      else if (!strcmp(token[1], "dirty_background_ratio") && value >= 0 && value <= 100)
       {
-        directory_ptr[dir_idx].hidden = 1;
+        dirty_background_ratio = value;
       }
-      else if (!strcmp(token[1], "-h") && directory_ptr[dir_idx].hidden == 1)
+      else if (!strcmp(token[1], "dirty_expire_secs") && value > 0)
       {
-        directory_ptr[dir_idx].hidden = 0;
+        dirty_expire_secs = value;
       }
-      else if (!strcmp(token[1], "+r") && directory_ptr[dir_idx].read_only == 0)
+      else if (!strcmp(token[1], "cache_budget") && value > 0)
       {
-        directory_ptr[dir_idx].read_only = 1;
+        cache_budget = value;
+        continue;
       }
-      else if (!strcmp(token[1], "-r") && directory_ptr[dir_idx].read_only == 1)
+      else
       {
-        directory_ptr[dir_idx].read_only = 0;
+        printf("Usage: tune [dirty_ratio | dirty_background_ratio | dirty_expire_secs |"
+               " cache_budget <value>]\n");
+        continue;
       }
-    }
 
-    /*CREATEFS*/
-    else if(!strcmp(token[0], "createfs"))
-    {
-      // Not yet implemented
-      continue;
+      pthread_cond_signal(&mnt->flush_wake);
     }
   }
 
-  //free directory_ptr.name
-  for (int i = 0; i < NUM_FILES; i++)
+  record_stop();
+
+  for (int m = MAX_MOUNTS - 1; m >= 0; m--)
   {
-    if (directory_ptr[i].name)
+    if (mounts[m] != NULL)
     {
-      free(directory_ptr[i].name);
-      directory_ptr[i].name = NULL;
+      mnt = mounts[m];
+      mount_free();
+      mounts[m] = NULL;
     }
   }
 
@@ -0,0 +1,392 @@
+// The MIT License (MIT)
+// 
+// Copyright (c) 2016, 2017 Trevor Bakker 
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Purpose:  Replays a workload recorded with the record command of mfs
+//           against any build of the shell, such as mfs or test.c, and
+//           reports the latency of every kind of command.  The shell runs
+//           on a pseudo terminal so its "mfs> " prompt is flushed before it
+//           waits for input; a command is done when the next prompt shows up.
+//
+//           mfs_replay [-p] [-i <image>] [-v] <recording> <shell> [args...]
+//
+//           -p  keep the original pacing instead of running flat out
+//           -i  run "openfs <image>" before the recording
+//           -v  print every command with its latency
+//
+//           Commands that name host files, like put, find them relative to
+//           the directory mfs_replay is started in.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define MAX_COMMAND_SIZE 255
+#define PROMPT "mfs> "
+#define MAX_COMMAND_KINDS 64
+#define RECORD_MAGIC 0x5253464d
+#define RECORD_VERSION 1
+
+// Must match struct record_entry in mfs.c
+struct record_entry {
+  uint64_t start_ns;
+  uint32_t latency_ns;
+  uint16_t len;
+} __attribute__((packed));
+
+// Latencies of one kind of command, by its first word
+struct command_kind {
+  char name[MAX_COMMAND_SIZE + 1];
+  unsigned long *latencies;
+  int count;
+  int capacity;
+  unsigned long recorded_ns;
+};
+
+struct command_kind kinds[MAX_COMMAND_KINDS];
+int num_kinds = 0;
+
+int shell_fd = -1;
+pid_t shell_pid = -1;
+
+unsigned long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+//start the shell on a new pseudo terminal with echo off
+int shell_start (char **argv)
+{
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+  {
+    return -1;
+  }
+
+  char *slave_name = ptsname(master);
+  int slave = open(slave_name, O_RDWR | O_NOCTTY);
+
+  if (slave == -1)
+  {
+    return -1;
+  }
+
+  struct termios tio;
+  tcgetattr(slave, &tio);
+  tio.c_lflag &= ~(ECHO | ECHONL);
+  tio.c_oflag &= ~OPOST;
+  tcsetattr(slave, TCSANOW, &tio);
+
+  shell_pid = fork();
+  if (shell_pid == -1)
+  {
+    return -1;
+  }
+
+  if (shell_pid == 0)
+  {
+    setsid();
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    dup2(slave, STDERR_FILENO);
+    close(master);
+    close(slave);
+    execvp(argv[0], argv);
+    perror("mfs_replay: Starting the shell returned");
+    _exit(127);
+  }
+
+  close(slave);
+  shell_fd = master;
+
+  return 0;
+}
+
+//read the shell's output until it prompts again.  Returns -1 if the
+//shell went away first.
+int shell_wait_prompt (int verbose)
+{
+  char buf[4096];
+  char tail[sizeof(PROMPT)] = "";
+
+  while (1)
+  {
+    ssize_t n = read(shell_fd, buf, sizeof(buf));
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+
+    if (verbose)
+    {
+      fwrite(buf, 1, n, stdout);
+    }
+
+    //the prompt can be split across reads, so keep the last few bytes
+    int keep = strlen(tail);
+    char joined[sizeof(tail) + sizeof(buf)];
+
+    memcpy(joined, tail, keep);
+    memcpy(joined + keep, buf, n);
+    int len = keep + n;
+
+    if (len >= (int) strlen(PROMPT) &&
+        !memcmp(joined + len - strlen(PROMPT), PROMPT, strlen(PROMPT)))
+    {
+      return 0;
+    }
+
+    int last = (len < (int) strlen(PROMPT)) ? len : (int) strlen(PROMPT) - 1;
+    memcpy(tail, joined + len - last, last);
+    tail[last] = '\0';
+  }
+}
+
+//send one command line and time it until the next prompt
+long shell_run (char *cmd, int verbose)
+{
+  char line[MAX_COMMAND_SIZE + 2];
+  int len = snprintf(line, sizeof(line), "%s\n", cmd);
+  unsigned long start = now_ns();
+
+  if (write(shell_fd, line, len) != len || shell_wait_prompt(verbose) == -1)
+  {
+    return -1;
+  }
+
+  return now_ns() - start;
+}
+
+struct command_kind *find_kind (char *cmd)
+{
+  char name[MAX_COMMAND_SIZE + 1];
+
+  if (sscanf(cmd, "%255s", name) != 1)
+  {
+    strcpy(name, "(blank)");
+  }
+
+  for (int i = 0; i < num_kinds; i++)
+  {
+    if (!strcmp(kinds[i].name, name))
+    {
+      return &kinds[i];
+    }
+  }
+
+  if (num_kinds == MAX_COMMAND_KINDS)
+  {
+    return NULL;
+  }
+
+  struct command_kind *kind = &kinds[num_kinds++];
+  strcpy(kind->name, name);
+
+  return kind;
+}
+
+void kind_add (struct command_kind *kind, unsigned long ns, unsigned long recorded_ns)
+{
+  if (kind->count == kind->capacity)
+  {
+    kind->capacity = (kind->capacity == 0) ? 64 : kind->capacity * 2;
+    kind->latencies = realloc(kind->latencies, kind->capacity * sizeof(unsigned long));
+  }
+
+  kind->latencies[kind->count++] = ns;
+  kind->recorded_ns += recorded_ns;
+}
+
+int compare_ns (const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *) a;
+  unsigned long y = *(const unsigned long *) b;
+
+  return (x > y) - (x < y);
+}
+
+void report (unsigned long wall_ns)
+{
+  printf("%-10s %8s %10s %10s %10s %10s %12s\n", "command", "count", "mean_us",
+         "p50_us", "p99_us", "max_us", "recorded_us");
+
+  for (int i = 0; i < num_kinds; i++)
+  {
+    struct command_kind *kind = &kinds[i];
+    unsigned long total = 0;
+
+    qsort(kind->latencies, kind->count, sizeof(unsigned long), compare_ns);
+    for (int j = 0; j < kind->count; j++)
+    {
+      total += kind->latencies[j];
+    }
+
+    printf("%-10s %8d %10.1f %10.1f %10.1f %10.1f %12.1f\n", kind->name, kind->count,
+           total / 1000.0 / kind->count,
+           kind->latencies[kind->count / 2] / 1000.0,
+           kind->latencies[(kind->count * 99) / 100] / 1000.0,
+           kind->latencies[kind->count - 1] / 1000.0,
+           kind->recorded_ns / 1000.0 / kind->count);
+  }
+
+  printf("replayed in %.3f ms\n", wall_ns / 1e6);
+}
+
+int main (int argc, char *argv[])
+{
+  int paced = 0;
+  int verbose = 0;
+  char *image = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "+pvi:")) != -1)
+  {
+    if (opt == 'p')      paced = 1;
+    else if (opt == 'v') verbose = 1;
+    else if (opt == 'i') image = optarg;
+    else
+    {
+      fprintf(stderr, "Use: mfs_replay [-p] [-i <image>] [-v] <recording> <shell> [args...]\n");
+      return 1;
+    }
+  }
+
+  if (argc - optind < 2)
+  {
+    fprintf(stderr, "Use: mfs_replay [-p] [-i <image>] [-v] <recording> <shell> [args...]\n");
+    return 1;
+  }
+
+  FILE *fp = fopen(argv[optind], "r");
+  uint32_t header[2];
+
+  if (fp == NULL)
+  {
+    perror("mfs_replay: Opening the recording returned");
+    return 1;
+  }
+
+  if (fread(header, sizeof(header), 1, fp) != 1 ||
+      header[0] != RECORD_MAGIC || header[1] != RECORD_VERSION)
+  {
+    fprintf(stderr, "mfs_replay: %s is not an mfs recording\n", argv[optind]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (shell_start(&argv[optind + 1]) == -1 || shell_wait_prompt(verbose) == -1)
+  {
+    fprintf(stderr, "mfs_replay: The shell did not start\n");
+    return 1;
+  }
+
+  if (image != NULL)
+  {
+    char cmd[MAX_COMMAND_SIZE + 1];
+
+    snprintf(cmd, sizeof(cmd), "openfs %s", image);
+    if (shell_run(cmd, verbose) == -1)
+    {
+      fprintf(stderr, "mfs_replay: The shell exited opening %s\n", image);
+      return 1;
+    }
+  }
+
+  struct record_entry entry;
+  char cmd[MAX_COMMAND_SIZE + 1];
+  unsigned long start = now_ns();
+  int replayed = 0;
+
+  while (fread(&entry, sizeof(entry), 1, fp) == 1)
+  {
+    if (entry.len > MAX_COMMAND_SIZE || fread(cmd, entry.len, 1, fp) != 1)
+    {
+      fprintf(stderr, "mfs_replay: The recording is truncated\n");
+      break;
+    }
+    cmd[entry.len] = '\0';
+
+    //wait until the command is as far into the replay as it was
+    //into the recording
+    if (paced)
+    {
+      unsigned long due = start + entry.start_ns;
+      unsigned long now = now_ns();
+
+      if (due > now)
+      {
+        struct timespec ts = { (due - now) / 1000000000UL, (due - now) % 1000000000UL };
+        nanosleep(&ts, NULL);
+      }
+    }
+
+    long ns = shell_run(cmd, verbose);
+
+    if (ns == -1)
+    {
+      fprintf(stderr, "mfs_replay: The shell exited during \"%s\"\n", cmd);
+      break;
+    }
+
+    if (verbose)
+    {
+      printf("\n[%ld us] %s\n", ns / 1000, cmd);
+    }
+
+    struct command_kind *kind = find_kind(cmd);
+    if (kind != NULL)
+    {
+      kind_add(kind, ns, entry.latency_ns);
+    }
+    replayed++;
+  }
+
+  unsigned long wall = now_ns() - start;
+
+  fclose(fp);
+
+  //quit lets mfs write back the image before it exits
+  if (write(shell_fd, "quit\n", 5) != 5)
+  {
+    kill(shell_pid, SIGTERM);
+  }
+  waitpid(shell_pid, NULL, 0);
+  close(shell_fd);
+
+  printf("%d commands\n", replayed);
+  report(wall);
+
+  return 0;
+}